@@ -22,13 +22,19 @@ SOURCES += \
     src/mainwindow.cpp \
     src/InstrumentPanel.cpp \
     src/DevicePanel.cpp \
-    src/Instrument.cpp
+    src/Instrument.cpp \
+    src/Song.cpp \
+    src/Sequencer.cpp \
+    src/Renderer.cpp
 
 HEADERS  += \
     src/mainwindow.h \
     src/InstrumentPanel.h \
     src/Instrument.h \
-    src/DevicePanel.h
+    src/DevicePanel.h \
+    src/Song.h \
+    src/Sequencer.h \
+    src/Renderer.h
 
 FORMS    += \
     src/mainwindow.ui \
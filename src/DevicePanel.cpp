@@ -4,9 +4,10 @@
 #include "devices/MIDIdefs.h"
 #include "devices/MIDIinput.h"
 #include "devices/MIDIoutput.h"
+#include "Sequencer.h"
+#include "Song.h"
 
 #include <QTime>
-#include <QFile>
 #include <QFileDialog>
 
 DevicePanel::DevicePanel(QWidget *parent)
@@ -14,9 +15,26 @@ DevicePanel::DevicePanel(QWidget *parent)
 	, ui(new Ui::DevicePanel)
 	, m_pCurrInput(nullptr)
 	, m_pCurrOutput(nullptr)
+	, m_testSong(new Song(1, 8))
+	, m_sequencer(new Sequencer(m_testSong))
 {
 	ui->setupUi(this);
 
+	// test stream data (kick, hihats, snare, hihats)
+	static const quint8 drums[8] = {36, 42, 44, 42, 40, 42, 44, 42};
+
+	m_testSong->instruments[0].name = tr("Drums");
+	m_testSong->instruments[0].channel = 9;
+
+	Track &track = m_testSong->tracks[0];
+	track.orders.append(track.addPattern());
+	for (uint row = 0; row < 8; row++)
+	{
+		SongCell cell;
+		cell.note = drums[row] + 1;
+		cell.instrument = 0;
+		track.setCell(0, row, cell);
+	}
 
 	// fill combos with all detected midi devices
 	for (auto device : MIDIInput::getDevices())
@@ -47,73 +65,42 @@ DevicePanel::DevicePanel(QWidget *parent)
 	{
 		if (m_pCurrOutput)
 		{
-			connect(m_pCurrOutput, SIGNAL(streamReady()), this, SLOT(updateStream()), Qt::UniqueConnection);
-			m_pCurrOutput->streamStart();
+			m_sequencer->play(m_pCurrOutput);
 		}
 	});
 
 	connect(ui->btnPauseStream, &QPushButton::clicked, [=]()
 	{
-		if (m_pCurrOutput)
-		{
-			m_pCurrOutput->streamPause();
-		}
+		m_sequencer->pause();
 	});
 
 	connect(ui->btnStopStream, &QPushButton::clicked, [=]()
 	{
-		if (m_pCurrOutput)
-		{
-			disconnect(m_pCurrOutput, SIGNAL(streamReady()), this, SLOT(updateStream()));
-			m_pCurrOutput->streamStop();
-		}
+		m_sequencer->stop();
 	});
 }
 
 // ------------------------------------------------------------------------------------------------
 DevicePanel::~DevicePanel()
 {
+	delete m_sequencer;
+	delete m_testSong;
 	delete ui;
 }
 
 // ------------------------------------------------------------------------------------------------
-void DevicePanel::updateStream()
+void DevicePanel::log(const QString &str)
 {
-	// test stream data
-
-	// kick
-	m_pCurrOutput->streamSend(0,  EVENT_NOTEON(9),  36, 127);
-	m_pCurrOutput->streamSend(24, EVENT_NOTEOFF(9), 36);
-
-	// hihats
-	m_pCurrOutput->streamSend(0,  EVENT_NOTEON(9),  42, 127);
-	m_pCurrOutput->streamSend(24, EVENT_NOTEOFF(9), 42);
-	m_pCurrOutput->streamSend(0,  EVENT_NOTEON(9),  44, 127);
-	m_pCurrOutput->streamSend(24, EVENT_NOTEOFF(9), 44);
-	m_pCurrOutput->streamSend(0,  EVENT_NOTEON(9),  42, 127);
-	m_pCurrOutput->streamSend(24, EVENT_NOTEOFF(9), 42);
-
-	// snare
-	m_pCurrOutput->streamSend(0,  EVENT_NOTEON(9),  40, 127);
-	m_pCurrOutput->streamSend(24, EVENT_NOTEOFF(9), 40);
-
-	// hihats
-	m_pCurrOutput->streamSend(0,  EVENT_NOTEON(9),  42, 127);
-	m_pCurrOutput->streamSend(24, EVENT_NOTEOFF(9), 42);
-	m_pCurrOutput->streamSend(0,  EVENT_NOTEON(9),  44, 127);
-	m_pCurrOutput->streamSend(24, EVENT_NOTEOFF(9), 44);
-	m_pCurrOutput->streamSend(0,  EVENT_NOTEON(9),  42, 127);
-	m_pCurrOutput->streamSend(24, EVENT_NOTEOFF(9), 42);
-
-//	qDebug("flushing stream, buffer size is %u", m_pCurrOutput->m_buffer.size());
-	m_pCurrOutput->streamFlush();
+	log(QStringList(str));
 }
 
 // ------------------------------------------------------------------------------------------------
-void DevicePanel::log(const QString &str)
+void DevicePanel::log(const QStringList &lines)
 {
-	ui->listInputData->addItem(str);
-	if (ui->listInputData->count() > 100)
+	if (lines.isEmpty()) return;
+
+	ui->listInputData->addItems(lines);
+	while (ui->listInputData->count() > 100)
 		delete ui->listInputData->takeItem(0);
 
 	ui->listInputData->scrollToBottom();
@@ -125,6 +112,7 @@ void DevicePanel::setInputDevice(int index)
 	if (m_pCurrInput)
 	{
 		log(tr("closing %1").arg(m_pCurrInput->name()));
+		m_pCurrInput->clearThru();
 		m_pCurrInput->close();
 
 		disconnect(m_pCurrInput, 0, this, 0);
@@ -138,16 +126,20 @@ void DevicePanel::setInputDevice(int index)
 		m_pCurrInput = devices[index];
 
 		connect(m_pCurrInput, SIGNAL(error(QString)), this, SLOT(receiveError(QString)));
-		connect(m_pCurrInput, SIGNAL(midiEvent(quint8, quint8, quint8, uint)),
-				this, SLOT(receiveMIDI(quint8, quint8, quint8, uint)));
-		connect(m_pCurrInput, SIGNAL(sysExRecorded(QByteArray, uint)),
-				this, SLOT(receiveSysEx(QByteArray, uint)));
+		connect(m_pCurrInput, SIGNAL(midiEvents(const MIDIInputEvent*, uint)),
+				this, SLOT(receiveMIDI(const MIDIInputEvent*, uint)));
+		connect(m_pCurrInput, SIGNAL(sysExSaved(QString, qint64, quint64)),
+				this, SLOT(receiveSysEx(QString, qint64, quint64)));
 
 		log(tr("opening %1").arg(m_pCurrInput->name()));
 		if (!m_pCurrInput->open())
 		{
 			log(tr("failed to open device"));
 		}
+		else if (m_pCurrOutput)
+		{
+			m_pCurrInput->setThru(m_pCurrOutput);
+		}
 	}
 	else
 	{
@@ -163,6 +155,9 @@ void DevicePanel::setOutputDevice(int index)
 	if (m_pCurrOutput)
 	{
 		log(tr("closing %1").arg(m_pCurrOutput->name()));
+		m_sequencer->stop();
+		if (m_pCurrInput)
+			m_pCurrInput->removeThru(m_pCurrOutput);
 		m_pCurrOutput->close();
 
 		disconnect(m_pCurrOutput, 0, this, 0);
@@ -182,6 +177,10 @@ void DevicePanel::setOutputDevice(int index)
 		{
 			log(tr("failed to open device"));
 		}
+		else if (m_pCurrInput)
+		{
+			m_pCurrInput->setThru(m_pCurrOutput);
+		}
 	}
 	else
 	{
@@ -192,22 +191,36 @@ void DevicePanel::setOutputDevice(int index)
 }
 
 // ------------------------------------------------------------------------------------------------
-void DevicePanel::receiveMIDI(quint8 event, quint8 data1, quint8 data2, uint time)
+void DevicePanel::receiveMIDI(const MIDIInputEvent *events, uint count)
 {
+	// (events are passed through to the output device by the input device itself)
 	if (!isVisible()) return;
 
-	if (m_pCurrOutput)
+	QStringList lines;
+	for (uint i = 0; i < count; i++)
 	{
-		m_pCurrOutput->send(event, data1, data2);
+		QString str = describeMIDI(events[i]);
+		if (!str.isEmpty())
+			lines.append(str);
 	}
 
-	QTime eventTime = QTime::fromMSecsSinceStartOfDay(time);
+	log(lines);
+}
+
+// ------------------------------------------------------------------------------------------------
+QString DevicePanel::describeMIDI(const MIDIInputEvent &ev) const
+{
+	quint8 event = ev.message.status();
+	quint8 data1 = ev.message.data1();
+	quint8 data2 = ev.message.data2();
+
+	QTime eventTime = QTime::fromMSecsSinceStartOfDay(ev.time / 1000);
 
 	QString str = tr("%1 channel %2 ")
 			.arg(eventTime.toString("hh:mm:ss.zzz"))
 			.arg((event & 0xF) + 1);
 
-	uint16_t pitch = data1 | (data2 << 7);
+	uint16_t pitch = ev.message.word();
 
 	switch (event >> 4) // TODO: MIDI event and RPN enums
 	{
@@ -241,10 +254,10 @@ void DevicePanel::receiveMIDI(quint8 event, quint8 data1, quint8 data2, uint tim
 		break;
 
 	default: // TODO: display system messages
-		return;
+		return QString();
 	}
 
-	log(str);
+	return str;
 }
 
 // ------------------------------------------------------------------------------------------------
@@ -260,36 +273,29 @@ void DevicePanel::recordSysEx()
 
 	if (!sysexPath.isEmpty())
 	{
-		m_sysexPath = sysexPath;
-		m_pCurrInput->recordSysEx();
-
-		log(tr("SysEx recording started (reset device to cancel)"));
+		if (m_pCurrInput->recordSysEx(sysexPath))
+			log(tr("SysEx recording started (reset device to cancel)"));
+		else
+			log(tr("unable to save %1").arg(sysexPath));
 	}
 }
 
 // ------------------------------------------------------------------------------------------------
-void DevicePanel::receiveSysEx(QByteArray data, uint time)
+void DevicePanel::receiveSysEx(QString fileName, qint64 size, quint64 time)
 {
-	QTime eventTime = QTime::fromMSecsSinceStartOfDay(time);
-
-	QString str = tr("%1 received SysEx (%2 bytes)")
-			.arg(eventTime.toString("hh:mm:ss.zzz"))
-			.arg(data.size());
-	log(str);
-
-	if (data.isEmpty()) return;
-
-	QFile file(m_sysexPath);
-	if (!file.open(QIODevice::WriteOnly))
+	if (!size)
 	{
-		log(tr("unable to save %1").arg(m_sysexPath));
+		log(tr("SysEx recording cancelled"));
 		return;
 	}
 
-	file.write(data);
-	file.close();
+	QTime eventTime = QTime::fromMSecsSinceStartOfDay(time / 1000);
 
-	log(tr("SysEx saved to %1").arg(m_sysexPath));
+	QString str = tr("%1 received SysEx (%2 bytes)")
+			.arg(eventTime.toString("hh:mm:ss.zzz"))
+			.arg(size);
+	log(str);
+	log(tr("SysEx saved to %1").arg(fileName));
 }
 
 // ------------------------------------------------------------------------------------------------
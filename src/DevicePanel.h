@@ -1,6 +1,7 @@
 #ifndef DEVICEPANEL_H
 #define DEVICEPANEL_H
 
+#include <QStringList>
 #include <QWidget>
 
 namespace Ui {
@@ -9,6 +10,9 @@ class DevicePanel;
 
 class MIDIInput;
 class MIDIOutput;
+class Sequencer;
+class Song;
+struct MIDIInputEvent;
 
 class DevicePanel : public QWidget
 {
@@ -24,12 +28,10 @@ private slots:
 
 	void recordSysEx();
 
-	void receiveMIDI(quint8 event, quint8 data1, quint8 data2, uint time);
-	void receiveSysEx(QByteArray data, uint time);
+	void receiveMIDI(const MIDIInputEvent *events, uint count);
+	void receiveSysEx(QString fileName, qint64 size, quint64 time);
 	void receiveError(QString);
 
-	void updateStream();
-
 signals:
 	void resetClicked();
 
@@ -42,9 +44,14 @@ private:
 	MIDIInput *m_pCurrInput;
 	MIDIOutput *m_pCurrOutput;
 
-	QString m_sysexPath;
+	// test song for the stream buttons
+	Song *m_testSong;
+	Sequencer *m_sequencer;
 
 	void log(const QString &str);
+	void log(const QStringList &lines);
+
+	QString describeMIDI(const MIDIInputEvent &ev) const;
 };
 
 #endif // DEVICEPANEL_H
@@ -1,29 +1,44 @@
 #include "Instrument.h"
 
-Instrument* Instrument::channelInstruments[16] = {0};
+#include <cstring>
 
-void Instrument::send(int time, MIDIOutput *out, quint8 data0, quint8 data1, quint8 data2)
+// ------------------------------------------------------------------------------------------------
+RecursiveMutex* Instrument::playLock()
 {
-	if (!out || channel > 15) return;
+	static RecursiveMutex lock;
+	return &lock;
+}
+
+// ------------------------------------------------------------------------------------------------
+void Instrument::send(int time, MIDISink *out, MIDIMessage message)
+{
+	if (!out) return;
+
+	QMutexLocker instrumentLock(playLock());
+	QMutexLocker lock(out->channels().lock());
+	int chn = checkInit(time, out);
+	if (chn < 0) return;
 
 	// always play MIDI events on this instrument's channel
-	if (data0 & 0x80)
-		data0 = EVENT_REROUTE(data0, channel);
+	// (so anything calling this can just build events for channel 0)
+	message = message.rerouted(chn);
 
-	checkInit(time, out);
+	track(out, chn, message);
 
 	if (time >= 0)
-		out->streamSend(time, data0, data1, data2);
+		out->streamSend(time, message);
 	else
-		out->send(data0, data1, data2);
+		out->send(message);
 }
 
 // ------------------------------------------------------------------------------------------------
-void Instrument::send(int time, MIDIOutput *out, const QByteArray &data)
+void Instrument::send(int time, MIDISink *out, const QByteArray &data)
 {
-	if (!out || channel > 15) return;
+	if (!out) return;
 
-	checkInit(time, out);
+	QMutexLocker instrumentLock(playLock());
+	QMutexLocker lock(out->channels().lock());
+	if (checkInit(time, out) < 0) return;
 
 	if (time >= 0)
 		out->streamSend(time, data);
@@ -32,109 +47,273 @@ void Instrument::send(int time, MIDIOutput *out, const QByteArray &data)
 }
 
 // ------------------------------------------------------------------------------------------------
-void Instrument::sendRPN(int time, MIDIOutput *out, quint16 param, quint16 value)
+void Instrument::sendRPN(int time, MIDISink *out, quint16 param, quint16 value)
 {
-	if (!out || channel > 15) return;
+	if (!out) return;
 
-	checkInit(time, out);
+	QMutexLocker instrumentLock(playLock());
+	QMutexLocker lock(out->channels().lock());
+	int chn = checkInit(time, out);
+	if (chn < 0) return;
 
 	if (time >= 0)
-		out->streamSendRPN(time, channel, param, value);
+		out->streamSendRPN(time, chn, param, value);
 	else
-		out->sendRPN(channel, param, value);
+		out->sendRPN(chn, param, value);
+
+	MIDIChannel &state = out->channels()[chn];
+	switch (param)
+	{
+	case RPN_PITCH_BEND_RANGE:
+		state.bendRange = value;
+		break;
+
+	case RPN_MASTER_TUNE:
+		state.tune = value;
+		break;
+
+	case RPN_MASTER_FINETUNE:
+		state.fineTune = value;
+		break;
+	}
 }
 
 // ------------------------------------------------------------------------------------------------
-void Instrument::sendNRPN(int time, MIDIOutput *out, quint16 param, quint16 value)
+void Instrument::sendNRPN(int time, MIDISink *out, quint16 param, quint16 value)
 {
-	if (!out || channel > 15) return;
+	if (!out) return;
 
-	checkInit(time, out);
+	QMutexLocker instrumentLock(playLock());
+	QMutexLocker lock(out->channels().lock());
+	int chn = checkInit(time, out);
+	if (chn < 0) return;
 
 	if (time >= 0)
-		out->streamSendNRPN(time, channel, param, value);
+		out->streamSendNRPN(time, chn, param, value);
 	else
-		out->sendNRPN(channel, param, value);
+		out->sendNRPN(chn, param, value);
+
+	out->channels()[chn].setNRPN(param, value);
 }
 
 // ------------------------------------------------------------------------------------------------
-void Instrument::init(int time, MIDIOutput *out)
+void Instrument::init(int time, MIDISink *out)
 {
-	if (!out || channel > 15) return;
+	if (!out) return;
+
+	QMutexLocker instrumentLock(playLock());
+	QMutexLocker lock(out->channels().lock());
+	int chn = this->allocate(out);
+	if (chn < 0) return;
+
+	this->initChannel(time, out, chn);
 
-	channelInstruments[channel] = this;
+	// keep the timing of whatever comes next, even if nothing had to be sent
+	if (time > 0)
+		out->streamDelay(time);
+}
+
+// ------------------------------------------------------------------------------------------------
+void Instrument::initChannel(int &time, MIDISink *out, quint8 chn)
+{
+	MIDIChannel &state = out->channels()[chn];
+
+	state.owner = this;
 	shouldReset = false;
 
-	// controller reset
-	this->send(time, out, EVENT_CONTROL(channel), CC_ALL_CONTROLLERS_OFF);
+	// only the first message sent gets the timestamp
+	auto sent = [&time]()
+	{
+		if (time > 0) time = 0;
+	};
+
+	// deliver the whole init sequence at once when sending immediately
+	if (time < 0)
+		out->beginBatch();
+
+	// controller reset, only if something else may have changed a controller
+	// which this instrument isn't going to set again
+	bool reset = !state.valid || state.external;
+
+	for (uint i = 0; !reset && i < 128; i++)
+	{
+		if (state.controls[i] == MIDIChannel::CONTROL_UNKNOWN)
+			continue;
+
+		reset = true;
+		for (const InstrumentMacro &m : macros)
+		{
+			if (m.type == InstrumentMacro::MacroCC && m.num == i)
+			{
+				reset = false;
+				break;
+			}
+		}
+	}
 
-	if (time > 0) time = 0;
+	if (reset)
+	{
+		this->send(time, out, MIDIMessage::control(0, CC_ALL_CONTROLLERS_OFF));
+		sent();
+	}
 
 	// send program and bank
-	this->send(time, out, EVENT_CONTROL(channel), CC_BANK_MSB, bank);
-	this->send(time, out, EVENT_CONTROL(channel), CC_BANK_LSB, bankLSB);
-	this->send(time, out, EVENT_PROGRAM(channel), program);
+	// (a new bank doesn't take effect until the next program change)
+	bool newBank = !state.valid || state.bank != bank || state.bankLSB != bankLSB;
+	if (newBank)
+	{
+		this->send(time, out, MIDIMessage::control(0, CC_BANK_MSB, bank));
+		sent();
+		this->send(time, out, MIDIMessage::control(0, CC_BANK_LSB, bankLSB));
+	}
+	if (newBank || state.program != program)
+	{
+		this->send(time, out, MIDIMessage::program(0, program));
+		sent();
+	}
 
 	// send pitch bend range
-	this->sendRPN(time, out, RPN_PITCH_BEND_RANGE, bendRange * (1 << 7));
+	quint16 value = bendRange * (1 << 7);
+	if (!state.valid || state.bendRange != value)
+	{
+		this->sendRPN(time, out, RPN_PITCH_BEND_RANGE, value);
+		sent();
+	}
 
 	// center pitch wheel
-	this->pitch(time, out, 0x2000);
+	currentPitch = 0x2000;
+	if (!state.valid || state.pitch != pitchValue(0x2000))
+	{
+		this->pitch(time, out, 0x2000);
+		sent();
+	}
 
 	// send transpose/finetune
 	double intPart;
 	double decPart = modf(transpose, &intPart);
 
-	this->sendRPN(time, out, RPN_MASTER_TUNE, (64 + (int)(intPart)) << 7);
-	this->sendRPN(time, out, RPN_MASTER_FINETUNE, (64 + (int)(64 * decPart)) << 7);
+	value = (64 + (int)(intPart)) << 7;
+	if (!state.valid || state.tune != value)
+	{
+		this->sendRPN(time, out, RPN_MASTER_TUNE, value);
+		sent();
+	}
+
+	value = (64 + (int)(64 * decPart)) << 7;
+	if (!state.valid || state.fineTune != value)
+	{
+		this->sendRPN(time, out, RPN_MASTER_FINETUNE, value);
+		sent();
+	}
 
-	// init macros
+	// init macros (SysEx macros are always sent, since there's no way to know what they did)
 	for (int i = 0; i < macros.size(); i++)
 	{
-		const InstrumentMacro &m = macros.at(i);
+		InstrumentMacro &m = macros[i];
+
+		if (state.valid && m.type == InstrumentMacro::MacroCC
+				&& m.num < 128 && state.controls[m.num] != MIDIChannel::CONTROL_UNKNOWN
+				&& state.controls[m.num] == m.init)
+		{
+			m.current = m.init;
+			continue;
+		}
+		else if (state.valid && m.type == InstrumentMacro::MacroNRPN
+				 && state.nrpn(m.num) == m.init)
+		{
+			m.current = m.init;
+			continue;
+		}
+
 		this->macro(time, out, i, 0, m.init);
+		sent();
 	}
+
+	state.valid = true;
+	state.external = false;
+
+	if (time < 0)
+		out->commitBatch();
 }
 
 // ------------------------------------------------------------------------------------------------
-void Instrument::noteOn(int time, MIDIOutput *out, quint8 note, quint8 velocity)
+void Instrument::noteOn(int time, MIDISink *out, quint8 note, quint8 velocity)
 {
 	if (velocity > 127)
 		velocity = this->velocity;
 
-	this->send(time, out, EVENT_NOTEON(channel), note, velocity);
+	this->send(time, out, MIDIMessage::noteOn(0, note, velocity));
 }
 
 // ------------------------------------------------------------------------------------------------
-void Instrument::noteOff(int time, MIDIOutput *out, quint8 note, quint8 velocity)
+void Instrument::noteOff(int time, MIDISink *out, quint8 note, quint8 velocity)
 {
+	if (!out) return;
+
 	if (velocity > 127)
 		velocity = this->velocity;
 
-	this->send(time, out, EVENT_NOTEOFF(channel), note, velocity);
+	// release the note on whatever channel it was played on, even if someone else owns it now
+	// (and never pick or set up a channel just to release a note)
+	QMutexLocker instrumentLock(playLock());
+	QMutexLocker lock(out->channels().lock());
+	MIDIChannelState &channels = out->channels();
+	int chn = channels.findNote(this, note);
+	for (int i = 0; chn < 0 && i < 16; i++)
+	{
+		// if the output forgot about the note, it can only still be playing on our own channel
+		if (channels[i].owner == this)
+			chn = i;
+	}
+
+	if (chn < 0)
+	{
+		// nothing to release, but keep the timing of whatever comes next
+		if (time > 0)
+			out->streamDelay(time);
+		return;
+	}
+
+	MIDIMessage message = MIDIMessage::noteOff(chn, note, velocity);
+	channels.trackNote(this, message);
+
+	if (time >= 0)
+		out->streamSend(time, message);
+	else
+		out->send(message);
 }
 
 // ------------------------------------------------------------------------------------------------
-void Instrument::pitch(int time, MIDIOutput *out, quint16 value)
+void Instrument::pitch(int time, MIDISink *out, quint16 value)
 {
+	QMutexLocker instrumentLock(playLock());
+
 	currentPitch = value;
-	qint16 center = 81.92 * pitchCenter;
+	value = this->pitchValue(value);
+
+	this->send(time, out, MIDIMessage::pitch(0, value));
+}
+
+// ------------------------------------------------------------------------------------------------
+quint16 Instrument::pitchValue(quint16 value) const
+{
+	qint16 center = pitchOffset();
 
 	if (value + center > 0x3FFF)
-		value = 0x3FFF;
+		return 0x3FFF;
 	else if (center < 0 && -center > value)
-		value = 0;
-	else
-		value += center;
+		return 0;
 
-	this->send(time, out, EVENT_PITCH(channel), MIDI_LSB(value), MIDI_MSB(value));
+	return value + center;
 }
 
 // ------------------------------------------------------------------------------------------------
-void Instrument::macro(int time, MIDIOutput *out, uint num, quint8 note, quint16 param)
+void Instrument::macro(int time, MIDISink *out, uint num, quint8 note, quint16 param)
 {
 	if (num >= (uint)macros.size()) return;
 
+	QMutexLocker instrumentLock(playLock());
+
 	InstrumentMacro &m = macros[num];
 
 	m.current = param;
@@ -142,7 +321,7 @@ void Instrument::macro(int time, MIDIOutput *out, uint num, quint8 note, quint16
 	switch (m.type)
 	{
 	case InstrumentMacro::MacroCC:
-		this->send(time, out, EVENT_CONTROL(channel), m.num, m.current);
+		this->send(time, out, MIDIMessage::control(0, m.num, m.current));
 		break;
 
 	case InstrumentMacro::MacroNRPN:
@@ -150,10 +329,217 @@ void Instrument::macro(int time, MIDIOutput *out, uint num, quint8 note, quint16
 		break;
 
 	case InstrumentMacro::MacroSysEx:
-	{
-		QByteArray data = m.formatSysEx(channel, param, note);
-		this->send(time, out, data);
+		if (out)
+		{
+			// the channel has to be known (and set up) before the message can be formatted
+			QMutexLocker lock(out->channels().lock());
+			int chn = checkInit(time, out);
+			if (chn < 0) break;
+
+			const QByteArray &data = m.seTemplate.format(chn, param, note);
+			if (!data.isEmpty())
+				this->send(time, out, data);
+		}
+		break;
 	}
+}
+
+// ------------------------------------------------------------------------------------------------
+void Instrument::track(MIDISink *out, quint8 chn, MIDIMessage message)
+{
+	out->channels().trackNote(this, message);
+
+	MIDIChannel &state = out->channels()[chn];
+	const quint8 data1 = message.data1();
+	const quint8 data2 = message.data2();
+
+	switch (message.type())
+	{
+	case MIDIMessage::Control:
+		switch (data1)
+		{
+		case CC_BANK_MSB:
+			state.bank = data2;
+			break;
+
+		case CC_BANK_LSB:
+			state.bankLSB = data2;
+			break;
+
+		case CC_ALL_CONTROLLERS_OFF:
+			state.resetControls();
+			state.pitch = 0x2000;
+			break;
+
+		// these don't leave anything behind that needs to be reset
+		case CC_DATA_ENTRY_MSB:
+		case CC_DATA_ENTRY_LSB:
+		case CC_DATA_BUTTON_INC:
+		case CC_DATA_BUTTON_DEC:
+		case CC_NRPN_LSB:
+		case CC_NRPN_MSB:
+		case CC_RPN_LSB:
+		case CC_RPN_MSB:
+			break;
+
+		default:
+			if (data1 < CC_ALL_SOUND_OFF)
+				state.controls[data1] = data2;
+			break;
+		}
+		break;
+
+	case MIDIMessage::Program:
+		state.program = data1;
+		break;
+
+	case MIDIMessage::Pitch:
+		state.pitch = message.word();
 		break;
 	}
 }
+
+// ------------------------------------------------------------------------------------------------
+bool SysExTemplate::parse(const QString &text)
+{
+	m_data.clear();
+	m_buffer.clear();
+	m_slots.clear();
+
+	uint nibbles = 0;
+	// checksums start after the SysEx start byte by default
+	quint16 start = 1;
+
+	auto addNibble = [&](quint8 value)
+	{
+		if (nibbles & 1)
+			m_data.data()[m_data.size() - 1] |= value;
+		else
+			m_data.append(char(value << 4));
+		nibbles++;
+	};
+
+	auto invalid = [&]()
+	{
+		m_data.clear();
+		m_slots.clear();
+		return false;
+	};
+
+	for (int i = 0; i < text.size(); i++)
+	{
+		QChar c = text[i];
+
+		if (c.isSpace())
+		{
+			continue;
+		}
+		else if (c == '%' && i + 1 < text.size())
+		{
+			Slot slot;
+			slot.type = text[++i].toLatin1();
+			slot.pos = nibbles / 2;
+			slot.start = start;
+			slot.shift = (nibbles & 1) ? 0 : 4;
+
+			switch (slot.type)
+			{
+			case 'c':
+				// (a channel in the upper digit could make the byte 0x80 or higher)
+				if (!(nibbles & 1)) return invalid();
+				addNibble(0);
+				break;
+
+			case 's':
+				if (nibbles & 1) return invalid();
+				start = nibbles / 2;
+				continue;
+
+			case 'C':
+			case 'n':
+			case 'v':
+			case 'k':
+				if (nibbles & 1) return invalid();
+				slot.shift = 0;
+				addNibble(0);
+				addNibble(0);
+				break;
+
+			default:
+				return invalid();
+			}
+
+			m_slots.append(slot);
+		}
+		else
+		{
+			bool ok;
+			quint8 value = QString(c).toUInt(&ok, 16);
+			if (!ok) return invalid();
+
+			addNibble(value);
+		}
+	}
+
+	if (nibbles & 1)
+		return invalid();
+
+	// must be a single, complete SysEx message with nothing but data bytes in between
+	// (all slots are still 0 here, and none of them can set the high bit)
+	const int size = m_data.size();
+	if (size < 2 || (quint8)m_data[0] != EVENT_SYSEX_START || (quint8)m_data[size - 1] != EVENT_SYSEX_END)
+		return invalid();
+
+	for (int i = 1; i < size - 1; i++)
+	{
+		if ((quint8)m_data[i] & 0x80)
+			return invalid();
+	}
+
+	m_buffer = m_data;
+	return true;
+}
+
+// ------------------------------------------------------------------------------------------------
+const QByteArray& SysExTemplate::format(quint8 channel, quint8 value, quint8 note)
+{
+	if (m_data.isEmpty())
+		return m_data;
+
+	char *data = m_buffer.data();
+	memcpy(data, m_data.constData(), m_data.size());
+
+	for (const Slot &slot : m_slots)
+	{
+		switch (slot.type)
+		{
+		case 'c':
+			data[slot.pos] |= (channel & 0xF) << slot.shift;
+			break;
+
+		case 'C':
+			data[slot.pos] = channel & 0x7F;
+			break;
+
+		case 'n':
+			data[slot.pos] = note & 0x7F;
+			break;
+
+		case 'v':
+			data[slot.pos] = value & 0x7F;
+			break;
+
+		case 'k':
+		{
+			uint sum = 0;
+			for (uint i = slot.start; i < slot.pos; i++)
+				sum += (quint8)data[i];
+
+			data[slot.pos] = (0x80 - (sum & 0x7F)) & 0x7F;
+		}
+			break;
+		}
+	}
+
+	return m_buffer;
+}
@@ -2,10 +2,54 @@
 #define INSTRUMENT_H
 
 #include <cmath>
+#include <QList>
+#include <QMutex>
+#include <QObject>
 #include <QString>
+#include <QVector>
 
 #include "devices/MIDIdefs.h"
-#include "devices/MIDIoutput.h"
+#include "devices/MIDIsink.h"
+
+/*
+ * A SysEx message template, parsed once from a string of hex digits and placeholders:
+ *   %c = channel (one digit, must be the second digit of a byte)
+ *   %C = channel (two digits)
+ *   %n = note (two digits)
+ *   %v = value (two digits)
+ *   %s = start of checksummed data (takes up no space)
+ *   %k = Roland-style checksum of everything since %s, or everything after the first byte
+ *        if there's no %s (two digits)
+ * Whitespace is ignored, and two-digit placeholders must start on a byte boundary.
+ * The template must start with F0, end with F7, and contain only data bytes (00-7F) in between.
+ * e.g. "F0 41 10 42 12 %s 40 1%c 15 %v %k F7"
+ */
+class SysExTemplate
+{
+public:
+	/* Parse a template string.
+	 * \returns whether or not the template was valid (if not, it formats to an empty message)
+	 */
+	bool parse(const QString &text);
+
+	/* \returns the message with all placeholders filled in.
+	 * The same buffer is reused each time, so this doesn't allocate anything once it has been
+	 * called for the first time (as long as the previous result isn't being held onto).
+	 * Instruments only call this while holding Instrument::playLock().
+	 */
+	const QByteArray& format(quint8 channel, quint8 value, quint8 note = 0);
+
+private:
+	struct Slot
+	{
+		quint16 pos, start;
+		char type;
+		quint8 shift;
+	};
+
+	QByteArray m_data, m_buffer;
+	QVector<Slot> m_slots;
+};
 
 struct InstrumentMacro
 {
@@ -18,51 +62,64 @@ struct InstrumentMacro
 	quint16 num = 0;
 	quint16 current = 0;
 	quint16 init = 0;
-	QString se;
-
-	friend struct Instrument;
 
-private:
-	QByteArray formatSysEx(uint8_t channel, uint8_t value, uint8_t note = 0)
+	const QString& sysEx() const
 	{
-		// TODO
-		QString result = se;
-		result	// %c = channel (one digit)
-				.replace("%c", QString::asprintf("%X", channel))
-				// %C = channel (two digits)
-				.replace("%C", QString::asprintf("%02X", channel))
-				// %n = note (two digits)
-				.replace("%n", QString::asprintf("%02X", note))
-				// %v = value (two digits)
-				.replace("%v", QString::asprintf("%02X", value));
+		return se;
+	}
+	bool setSysEx(const QString &text)
+	{
+		se = text;
+		return seTemplate.parse(text);
+	}
 
-		// TODO: convert hex string to bytearray
+	friend struct Instrument;
 
-		return QByteArray();
-	}
+private:
+	QString se;
+	SysExTemplate seTemplate;
 };
 
 struct Instrument
 {
 private:
-	// map instruments to MIDI channels
-	static Instrument* channelInstruments[16];
-
-	void checkInit(int& time, MIDIOutput *out)
+	// (the sink's channel state must be locked when calling these)
+	int allocate(MIDISink *out)
+	{
+		return out->channels().allocate(this, channel == AutoChannel ? -1 : channel & 0xF,
+										program, bank, bankLSB);
+	}
+	// \returns the channel to play on, which is set up first if needed (or -1 if there isn't one)
+	int checkInit(int& time, MIDISink *out)
 	{
-		if (shouldReset || channelInstruments[channel] != this)
-		{
-			this->init(time, out);
-			if (time > 0) time = 0;
-		}
+		int chn = this->allocate(out);
+		if (chn >= 0 && (shouldReset || out->channels()[chn].owner != this))
+			this->initChannel(time, out, chn);
+		return chn;
 	}
 
+	void initChannel(int& time, MIDISink *out, quint8 chn);
+	void track(MIDISink *out, quint8 chn, MIDIMessage message);
+
+	quint16 pitchValue(quint16 value) const;
+
 public:
 
 	bool shouldReset = true;
 
+	enum
+	{
+		// play on whichever channel of the output device is available (see MIDIChannelState)
+		AutoChannel = 0xFF
+	};
+
+	/* Instruments can be played from more than one thread at once (e.g. the sequencer and
+	 * the GUI), so everything that plays one holds this first (before any sink's lock).
+	 */
+	static RecursiveMutex* playLock();
+
 	QString name = QObject::tr("New instrument");
-	quint8 channel = 0;
+	quint8 channel = AutoChannel;
 
 	quint8 velocity = 127;
 
@@ -77,56 +134,87 @@ public:
 
 	QList<InstrumentMacro> macros;
 
-	void send(int time, MIDIOutput *out, quint8 data0, quint8 data1 = 0, quint8 data2 = 0);
-	void send(MIDIOutput *out, quint8 data0, quint8 data1 = 0, quint8 data2 = 0)
+	// offset from the center of the pitch wheel, in pitch bend units
+	qint16 pitchOffset() const
+	{
+		return 81.92 * pitchCenter;
+	}
+
+	/* Initialize this instrument's channel if needed, before something else sends to it.
+	 * \returns the channel being used on this sink, or -1 if there isn't one
+	 */
+	int prepare(MIDISink *out)
+	{
+		int time = -1;
+		if (!out) return -1;
+
+		QMutexLocker instrumentLock(playLock());
+		QMutexLocker lock(out->channels().lock());
+		int chn = checkInit(time, out);
+		if (chn >= 0)
+			out->channels()[chn].external = true;
+		return chn;
+	}
+
+	// (channel messages are always sent on this instrument's channel)
+	void send(int time, MIDISink *out, MIDIMessage message);
+	void send(MIDISink *out, MIDIMessage message)
+	{
+		send(-1, out, message);
+	}
+	void send(int time, MIDISink *out, quint8 data0, quint8 data1 = 0, quint8 data2 = 0)
+	{
+		send(time, out, MIDIMessage(data0, data1, data2));
+	}
+	void send(MIDISink *out, quint8 data0, quint8 data1 = 0, quint8 data2 = 0)
 	{
-		send(-1, out, data0, data1, data2);
+		send(-1, out, MIDIMessage(data0, data1, data2));
 	}
 
-	void send(int time, MIDIOutput *out, const QByteArray &data);
-	void send(MIDIOutput *out, const QByteArray &data)
+	void send(int time, MIDISink *out, const QByteArray &data);
+	void send(MIDISink *out, const QByteArray &data)
 	{
 		send(-1, out, data);
 	}
 
-	void sendRPN(int time, MIDIOutput *out, quint16 param, quint16 value);
-	void sendRPN(MIDIOutput *out, quint16 param, quint16 value)
+	void sendRPN(int time, MIDISink *out, quint16 param, quint16 value);
+	void sendRPN(MIDISink *out, quint16 param, quint16 value)
 	{
 		sendRPN(-1, out, param, value);
 	}
 
-	void sendNRPN(int time, MIDIOutput *out, quint16 param, quint16 value);
-	void sendNRPN(MIDIOutput *out, quint16 param, quint16 value)
+	void sendNRPN(int time, MIDISink *out, quint16 param, quint16 value);
+	void sendNRPN(MIDISink *out, quint16 param, quint16 value)
 	{
 		sendNRPN(-1, out, param, value);
 	}
 
-	void init(int time, MIDIOutput *out);
-	void init(MIDIOutput *out)
+	void init(int time, MIDISink *out);
+	void init(MIDISink *out)
 	{
 		init(-1, out);
 	}
 
-	void noteOn(int time, MIDIOutput *out, quint8 note, quint8 velocity = (quint8)-1u);
-	void noteOn(MIDIOutput *out, quint8 note, quint8 velocity = (quint8)-1u)
+	void noteOn(int time, MIDISink *out, quint8 note, quint8 velocity = (quint8)-1u);
+	void noteOn(MIDISink *out, quint8 note, quint8 velocity = (quint8)-1u)
 	{
 		noteOn(-1, out, note, velocity);
 	}
 
-	void noteOff(int time, MIDIOutput *out, quint8 note, quint8 velocity = (quint8)-1u);
-	void noteOff(MIDIOutput *out, quint8 note, quint8 velocity = (quint8)-1u)
+	void noteOff(int time, MIDISink *out, quint8 note, quint8 velocity = (quint8)-1u);
+	void noteOff(MIDISink *out, quint8 note, quint8 velocity = (quint8)-1u)
 	{
 		noteOff(-1, out, note, velocity);
 	}
 
-	void pitch(int time, MIDIOutput *out, quint16 value);
-	void pitch(MIDIOutput *out, quint16 value)
+	void pitch(int time, MIDISink *out, quint16 value);
+	void pitch(MIDISink *out, quint16 value)
 	{
 		pitch(-1, out, value);
 	}
 
-	void macro(int time, MIDIOutput *out, uint num, quint8 note, quint16 param);
-	void macro(MIDIOutput *out, uint num, quint8 note, quint16 param)
+	void macro(int time, MIDISink *out, uint num, quint8 note, quint16 param);
+	void macro(MIDISink *out, uint num, quint8 note, quint16 param)
 	{
 		macro(-1, out, num, note, param);
 	}
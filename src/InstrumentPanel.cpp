@@ -6,21 +6,21 @@
 #include "devices/MIDIinput.h"
 #include "devices/MIDIoutput.h"
 
+#include <QHideEvent>
 #include <QMessageBox>
 
-InstrumentPanel::InstrumentPanel(QWidget *parent)
+InstrumentPanel::InstrumentPanel(Song *song, QWidget *parent)
 	: QWidget(parent)
 	, ui(new Ui::InstrumentPanel)
+	, m_song(song)
 	, m_pCurrInput(nullptr)
 	, m_pCurrOutput(nullptr)
+	, m_updatingForm(false)
 {
 	ui->setupUi(this);
 
-	for (int i = 0; i < 64; i++)
-	{
-		m_instruments[i].channel = (i % 16);
-	}
-	m_pCurrInst = &m_instruments[0];
+	// (instruments get a channel from the output device when they're used)
+	m_pCurrInst = &m_song->instruments[0];
 	updateForm();
 
 	// set up ui controls
@@ -29,7 +29,7 @@ InstrumentPanel::InstrumentPanel(QWidget *parent)
 
 	connect(ui->editInstNum, valueChangedInt, [=](int val)
 	{
-		m_pCurrInst = &m_instruments[val-1];
+		m_pCurrInst = &m_song->instruments[val-1];
 		updateForm();
 	});
 
@@ -62,48 +62,56 @@ InstrumentPanel::InstrumentPanel(QWidget *parent)
 	{
 		m_pCurrInst->bank = val;
 		m_pCurrInst->shouldReset = true;
+		updateThru();
 	});
 
 	connect(ui->editBankLSB, valueChangedInt, [=](int val)
 	{
 		m_pCurrInst->bankLSB = val;
 		m_pCurrInst->shouldReset = true;
+		updateThru();
 	});
 
 	connect(ui->editBendRange, valueChangedDouble, [=](double val)
 	{
 		m_pCurrInst->bendRange = val;
 		m_pCurrInst->shouldReset = true;
+		updateThru();
 	});
 
 	connect(ui->editOutputChn, valueChangedInt, [=](int val)
 	{
-		m_pCurrInst->channel = val - 1;
+		m_pCurrInst->channel = val ? val - 1 : Instrument::AutoChannel;
 		m_pCurrInst->shouldReset = true;
+		updateThru();
 	});
 
 	connect(ui->editProgramNum, valueChangedInt, [=](int val)
 	{
 		m_pCurrInst->program = val;
 		m_pCurrInst->shouldReset = true;
+		updateThru();
 	});
 
 	connect(ui->editTranspose, valueChangedDouble, [=](double val)
 	{
 		m_pCurrInst->transpose = val;
 		m_pCurrInst->shouldReset = true;
+		updateThru();
 	});
 
 	connect(ui->editVelocity, valueChangedInt, [=](int val)
 	{
 		m_pCurrInst->velocity = val;
 		m_pCurrInst->shouldReset = true;
+		updateThru();
 	});
 
 	connect(ui->editPitchCenter, valueChangedDouble, [=](double val)
 	{
 		m_pCurrInst->pitchCenter = val;
 		m_pCurrInst->shouldReset = true;
+		updateThru();
 	});
 }
 
@@ -116,8 +124,14 @@ InstrumentPanel::~InstrumentPanel()
 // ------------------------------------------------------------------------------------------------
 void InstrumentPanel::updateForm()
 {
+	// changing the form's values will try to update thru settings repeatedly
+	m_updatingForm = true;
+
 	ui->editInstName->setText(m_pCurrInst->name);
-	ui->editOutputChn->setValue(m_pCurrInst->channel + 1);
+	if (m_pCurrInst->channel == Instrument::AutoChannel)
+		ui->editOutputChn->setValue(0);
+	else
+		ui->editOutputChn->setValue(m_pCurrInst->channel + 1);
 	ui->editVelocity->setValue(m_pCurrInst->velocity);
 	ui->editProgramNum->setValue(m_pCurrInst->program);
 	ui->editBank->setValue(m_pCurrInst->bank);
@@ -125,6 +139,8 @@ void InstrumentPanel::updateForm()
 	ui->editTranspose->setValue(m_pCurrInst->transpose);
 	ui->editBendRange->setValue(m_pCurrInst->bendRange);
 
+	m_updatingForm = false;
+	updateThru();
 }
 
 // ------------------------------------------------------------------------------------------------
@@ -137,12 +153,7 @@ void InstrumentPanel::setInputDevice(MIDIInput *input)
 	}
 
 	m_pCurrInput = input;
-
-	if (input)
-	{
-		connect(m_pCurrInput, SIGNAL(midiEvent(quint8, quint8, quint8, uint)),
-				this, SLOT(receiveMIDI(quint8, quint8, quint8)));
-	}
+	updateThru();
 }
 
 // ------------------------------------------------------------------------------------------------
@@ -155,35 +166,44 @@ void InstrumentPanel::setOutputDevice(MIDIOutput *output)
 	}
 
 	m_pCurrOutput = output;
+	updateThru();
 }
 
 // ------------------------------------------------------------------------------------------------
-void InstrumentPanel::receiveMIDI(quint8 event, quint8 data1, quint8 data2)
+void InstrumentPanel::showEvent(QShowEvent *event)
 {
-	if (!isVisible()) return;
+	QWidget::showEvent(event);
+	updateThru();
+}
 
-	switch (event & 0xF0)
-	{
-	case EVENT_NOTEOFF(0):
-		if (m_pCurrOutput)
-			m_pCurrInst->noteOff(m_pCurrOutput, data1);
-		break;
-
-	case EVENT_NOTEON(0):
-		if (m_pCurrOutput)
-			m_pCurrInst->noteOn(m_pCurrOutput, data1);
-		break;
-
-	case EVENT_PITCH(0):
-		if (m_pCurrOutput)
-			m_pCurrInst->pitch(m_pCurrOutput, MIDI_WORD(data2, data1));
-		break;
-
-	default:
-		if (m_pCurrOutput)
-			m_pCurrInst->send(m_pCurrOutput, event, data1, data2);
-		break;
-
-		// TODO: capture CC/PC messages here when recording
-	}
+// ------------------------------------------------------------------------------------------------
+void InstrumentPanel::hideEvent(QHideEvent *event)
+{
+	QWidget::hideEvent(event);
+
+	// ignore the window itself being minimized
+	if (event->spontaneous()) return;
+
+	// go back to passing events through unchanged
+	if (m_pCurrInput && m_pCurrOutput)
+		m_pCurrInput->setThru(m_pCurrOutput);
+}
+
+// ------------------------------------------------------------------------------------------------
+void InstrumentPanel::updateThru()
+{
+	// while this panel is visible, incoming events are played on the current instrument
+	if (m_updatingForm || !isVisible() || !m_pCurrInput || !m_pCurrOutput) return;
+
+	int chn = m_pCurrInst->prepare(m_pCurrOutput);
+	if (chn < 0) return;
+
+	MIDIThru thru;
+	thru.channel = chn;
+	thru.velocity = m_pCurrInst->velocity;
+	thru.pitchOffset = m_pCurrInst->pitchOffset();
+
+	m_pCurrInput->setThru(m_pCurrOutput, thru);
+
+	// TODO: capture CC/PC messages here when recording
 }
@@ -3,6 +3,7 @@
 
 #include <QWidget>
 #include "Instrument.h"
+#include "Song.h"
 
 namespace Ui {
 class InstrumentPanel;
@@ -16,28 +17,31 @@ class InstrumentPanel : public QWidget
 	Q_OBJECT
 
 public:
-	explicit InstrumentPanel(QWidget *parent = 0);
+	explicit InstrumentPanel(Song *song, QWidget *parent = 0);
 	~InstrumentPanel();
 
 public slots:
 	void setInputDevice(MIDIInput*);
 	void setOutputDevice(MIDIOutput*);
 
-private slots:
-	void receiveMIDI(quint8 event, quint8 data1, quint8 data2);
+protected:
+	void showEvent(QShowEvent*);
+	void hideEvent(QHideEvent*);
 
 private:
 	Ui::InstrumentPanel *ui;
 
 	void updateForm();
+	void updateThru();
 
-	// move this into the actual song eventually (once it exists)
-	Instrument m_instruments[64];
+	Song *m_song;
 	Instrument *m_pCurrInst;
 
 	// pointers to devices selected on device panel
 	MIDIInput *m_pCurrInput;
 	MIDIOutput *m_pCurrOutput;
+
+	bool m_updatingForm;
 };
 
 #endif // INSTRUMENTPANEL_H
@@ -0,0 +1,171 @@
+#include "Renderer.h"
+
+#include <QRunnable>
+#include <QSemaphore>
+#include <QThreadPool>
+
+#include <algorithm>
+
+// ------------------------------------------------------------------------------------------------
+SongRenderer::SongRenderer(const Song *song)
+	: m_song(song)
+	, m_length(0)
+{
+}
+
+// ------------------------------------------------------------------------------------------------
+quint32 SongRenderer::render(MIDISink *out, QThreadPool *pool)
+{
+	if (!out || !m_song) return 0;
+
+	if (!pool)
+		pool = QThreadPool::globalInstance();
+
+	const uint tracks = m_song->tracks.size();
+	m_events.resize(tracks);
+	m_length = m_song->length() * m_song->rows() * qMax(m_song->ticksPerRow, 1u);
+
+	// render every track (except the first, which this thread does while waiting for the others)
+	class TrackJob : public QRunnable
+	{
+	public:
+		TrackJob(SongRenderer *renderer, uint track, QSemaphore *done)
+			: m_renderer(renderer), m_track(track), m_done(done)
+		{
+		}
+
+		void run()
+		{
+			m_renderer->renderTrack(m_track);
+			m_done->release();
+		}
+
+	private:
+		SongRenderer *m_renderer;
+		uint m_track;
+		QSemaphore *m_done;
+	};
+
+	QSemaphore done;
+	for (uint i = 1; i < tracks; i++)
+		pool->start(new TrackJob(this, i, &done));
+
+	if (tracks)
+		this->renderTrack(0);
+	done.acquire(qMax(tracks, 1u) - 1);
+
+	// play everything through fresh copies of the instruments, so the song's own instruments
+	// (and whatever they're currently playing on) aren't affected
+	{
+		// (they may be playing on another thread right now)
+		QMutexLocker lock(Instrument::playLock());
+
+		for (int i = 0; i < 64; i++)
+		{
+			m_instruments[i] = m_song->instruments[i];
+			m_instruments[i].shouldReset = true;
+		}
+	}
+
+	this->merge(out);
+	return m_length;
+}
+
+// ------------------------------------------------------------------------------------------------
+void SongRenderer::renderTrack(uint track)
+{
+	const Track &source = m_song->tracks[track];
+	QVector<SongEvent> &events = m_events[track];
+
+	// (this doesn't free the memory, so it can be reused next time)
+	events.resize(0);
+
+	const uint length = m_song->length();
+	const uint rows = m_song->rows();
+	const uint ticksPerRow = qMax(m_song->ticksPerRow, 1u);
+
+	TrackPlayer player;
+	quint32 time = 0;
+
+	for (uint order = 0; order < length && order < (uint)source.orders.size(); order++)
+	{
+		for (uint row = 0; row < rows; row++, time += ticksPerRow)
+			player.renderRow(source, order, row, time, events);
+	}
+
+	// notes still playing at the end of the track last until the end of the song
+	player.release(m_length, events);
+}
+
+// ------------------------------------------------------------------------------------------------
+void SongRenderer::merge(MIDISink *out)
+{
+	// k-way merge of every track's events, using a heap of each track's next event
+	// ordered by time and then by track
+	struct Head
+	{
+		quint32 time;
+		uint track;
+
+		// (reversed, so the heap has the earliest event on top)
+		bool operator<(const Head &other) const
+		{
+			return time != other.time ? time > other.time : track > other.track;
+		}
+	};
+
+	QVector<Head> heap;
+	QVector<uint> next(m_events.size(), 0);
+
+	for (int i = 0; i < m_events.size(); i++)
+	{
+		if (!m_events[i].isEmpty())
+		{
+			Head head = {m_events[i][0].time, (uint)i};
+			heap.append(head);
+		}
+	}
+	std::make_heap(heap.begin(), heap.end());
+
+	quint32 time = 0;
+	out->streamSetTempo(0, m_song->tempo);
+
+	// everything at the same time is sent to the output at once
+	MIDIBatchSink batch(out);
+
+	while (!heap.isEmpty())
+	{
+		std::pop_heap(heap.begin(), heap.end());
+		Head &head = heap.last();
+
+		const QVector<SongEvent> &events = m_events[head.track];
+		uint &pos = next[head.track];
+
+		if (head.time != time)
+			batch.flush();
+
+		// play all of this track's events at this time
+		// (the delay is sent separately in case the events end up not sending anything)
+		batch.streamDelay(head.time - time);
+		time = head.time;
+
+		do
+		{
+			events[pos++].play(0, m_instruments, &batch);
+		}
+		while (pos < (uint)events.size() && events[pos].time == time);
+
+		if (pos < (uint)events.size())
+		{
+			head.time = events[pos].time;
+			std::push_heap(heap.begin(), heap.end());
+		}
+		else
+		{
+			heap.removeLast();
+		}
+	}
+
+	batch.flush();
+	out->streamDelay(m_length - time);
+}
@@ -0,0 +1,47 @@
+/*
+ * Offline song renderer.
+ *
+ * Renders a whole song (every entry of the order list, once) into a sink as fast as possible,
+ * without an output device or a clock, e.g. to export it or to check what it sends.
+ *
+ * Each track is turned into a list of events on its own, using a thread pool. The lists are then
+ * merged by time (events at the same time stay in track order, and each track's events stay in
+ * their original order) and played through a copy of the song's instruments, which set up and
+ * pick channels on the sink just like during playback. The result is the same no matter how many
+ * threads were used.
+ */
+
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include "Sequencer.h"
+#include "Song.h"
+
+class QThreadPool;
+
+class SongRenderer
+{
+public:
+	explicit SongRenderer(const Song *song);
+
+	/* Render the song.
+	 * The sink's channel state is used as is, so it should usually be new or cleared first.
+	 * \param out the sink to render to (everything is sent with stream timestamps)
+	 * \param pool the thread pool to render tracks with (or the global one, if null)
+	 * \returns the length of the song in ticks (at 96 ticks per quarter note)
+	 */
+	quint32 render(MIDISink *out, QThreadPool *pool = 0);
+
+private:
+	void renderTrack(uint track);
+	void merge(MIDISink *out);
+
+	const Song *m_song;
+	Instrument m_instruments[64];
+
+	// (kept between renders so the memory can be reused)
+	QVector<QVector<SongEvent>> m_events;
+	quint32 m_length;
+};
+
+#endif // RENDERER_H
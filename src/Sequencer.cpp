@@ -0,0 +1,278 @@
+#include "Sequencer.h"
+#include "Song.h"
+#include "devices/MIDIoutput.h"
+
+#include <QThread>
+
+// ------------------------------------------------------------------------------------------------
+void SongEvent::play(int time, Instrument *instruments, MIDISink *out) const
+{
+	Instrument &inst = instruments[instrument];
+
+	switch (type)
+	{
+	case NoteOff:
+		inst.noteOff(time, out, note, value);
+		break;
+
+	case NoteOn:
+		inst.noteOn(time, out, note, value);
+		break;
+
+	case Macro:
+		inst.macro(time, out, value, note, param);
+		break;
+	}
+}
+
+// ------------------------------------------------------------------------------------------------
+void TrackPlayer::renderRow(const Track &track, uint order, uint row, quint32 time,
+							QVector<SongEvent> &events)
+{
+	if (order >= (uint)track.orders.size()) return;
+
+	const PatternView view = track.pattern(track.orders[order]);
+	if (row >= view.rows) return;
+
+	const quint8 note = view.note[row];
+	const quint8 instrument = view.instrument[row];
+	const quint8 volume = view.volume[row];
+
+	// end the current note before playing another one or switching instruments
+	if (m_note >= 0 && (note != SongCell::NoteNone
+			|| (instrument < 64 && instrument != m_instrument)))
+	{
+		this->release(time, events);
+	}
+
+	if (instrument < 64)
+		m_instrument = instrument;
+	if (m_instrument < 0) return;
+
+	SongEvent event = {};
+	event.time = time;
+	event.instrument = m_instrument;
+
+	// effect commands 1 and up run the instrument's macros 0 and up
+	for (uint col = 0; col < track.effectColumns(); col++)
+	{
+		const quint8 effect = view.effect[col][row];
+		if (effect == SongCell::EffectNone) continue;
+
+		event.type = SongEvent::Macro;
+		event.note = qMax(m_note, 0);
+		event.value = effect - 1;
+		event.param = view.param[col][row];
+		events.append(event);
+	}
+
+	if (note != SongCell::NoteNone && note != SongCell::NoteOff)
+	{
+		m_note = note - 1;
+
+		event.type = SongEvent::NoteOn;
+		event.note = m_note;
+		event.value = volume < 128 ? volume : (quint8)-1u;
+		event.param = 0;
+		events.append(event);
+	}
+}
+
+// ------------------------------------------------------------------------------------------------
+void TrackPlayer::release(quint32 time, QVector<SongEvent> &events)
+{
+	if (m_note < 0) return;
+
+	SongEvent event = {};
+	event.time = time;
+	event.type = SongEvent::NoteOff;
+	event.instrument = m_instrument;
+	event.note = m_note;
+	event.value = (quint8)-1u;
+	events.append(event);
+
+	m_note = -1;
+}
+
+// ------------------------------------------------------------------------------------------------
+Sequencer::Sequencer(Song *song)
+	: QObject()
+	, m_thread(new QThread())
+	, m_song(song)
+	, m_output(nullptr)
+	, m_paused(false)
+	, m_lookahead(192)
+	, m_order(0)
+	, m_row(0)
+	, m_jumped(false)
+{
+	// (the thread can't be this object's child, since this object is moved to it)
+	m_thread->setObjectName("Sequencer");
+	this->moveToThread(m_thread);
+	m_thread->start();
+}
+
+// ------------------------------------------------------------------------------------------------
+Sequencer::~Sequencer()
+{
+	this->stop();
+
+	m_thread->quit();
+	m_thread->wait();
+	delete m_thread;
+}
+
+// ------------------------------------------------------------------------------------------------
+void Sequencer::setSong(Song *song)
+{
+	this->stop();
+
+	QMutexLocker lock(&m_lock);
+	m_song = song;
+}
+
+// ------------------------------------------------------------------------------------------------
+void Sequencer::setLookahead(uint ticks)
+{
+	QMutexLocker lock(&m_lock);
+	m_lookahead = qMax(ticks, 1u);
+}
+
+// ------------------------------------------------------------------------------------------------
+bool Sequencer::play(MIDIOutput *out)
+{
+	if (!out || !m_song) return false;
+
+	if (out != m_output || !m_paused)
+		this->stop();
+
+	QMutexLocker lock(&m_lock);
+
+	if (!m_output)
+	{
+		m_output = out;
+		this->reset();
+	}
+	m_paused = false;
+
+	// streamReady() is emitted from the platform's input thread (or output callback), so this
+	// ends up calling render() on the sequencer's thread
+	connect(out, SIGNAL(streamReady()), this, SLOT(render()), Qt::UniqueConnection);
+
+	if (!out->streamStart(m_song->tempo, 96))
+	{
+		disconnect(out, SIGNAL(streamReady()), this, SLOT(render()));
+		m_output = nullptr;
+		return false;
+	}
+
+	return true;
+}
+
+// ------------------------------------------------------------------------------------------------
+void Sequencer::pause()
+{
+	QMutexLocker lock(&m_lock);
+
+	if (m_output && !m_paused)
+	{
+		m_output->streamPause();
+		m_paused = true;
+	}
+}
+
+// ------------------------------------------------------------------------------------------------
+void Sequencer::stop()
+{
+	QMutexLocker lock(&m_lock);
+
+	if (m_output)
+	{
+		disconnect(m_output, SIGNAL(streamReady()), this, SLOT(render()));
+		// (this also turns off any notes that are still playing)
+		m_output->streamStop();
+
+		m_output = nullptr;
+		m_paused = false;
+	}
+}
+
+// ------------------------------------------------------------------------------------------------
+void Sequencer::reset()
+{
+	m_order = m_row = 0;
+	m_jumped = false;
+
+	m_tracks.resize(m_song->tracks.size());
+	for (TrackPlayer &player : m_tracks)
+		player.reset();
+}
+
+// ------------------------------------------------------------------------------------------------
+void Sequencer::render()
+{
+	QMutexLocker lock(&m_lock);
+
+	// (a request may still be queued from before the stream was stopped)
+	if (!m_output || m_paused) return;
+
+	const uint ticksPerRow = qMax(m_song->ticksPerRow, 1u);
+
+	if (!m_song->length())
+	{
+		m_output->streamDelay(m_lookahead);
+	}
+	else
+	{
+		// send all of the rows to the output at once
+		MIDIBatchSink batch(m_output);
+
+		for (uint ticks = 0; ticks < m_lookahead; ticks += ticksPerRow)
+		{
+			this->renderRow(&batch);
+			batch.streamDelay(ticksPerRow);
+		}
+
+		batch.flush();
+	}
+
+	m_output->streamFlush();
+}
+
+// ------------------------------------------------------------------------------------------------
+void Sequencer::renderRow(MIDISink *out)
+{
+	// (this doesn't free the memory, so it can be reused for every row)
+	m_events.resize(0);
+
+	if (m_jumped)
+	{
+		// end everything that's still playing before starting over somewhere else
+		for (TrackPlayer &player : m_tracks)
+			player.release(0, m_events);
+
+		for (const SongEvent &event : m_events)
+			event.play(0, m_song->instruments, out);
+		m_events.resize(0);
+
+		// (including anything the instruments left on themselves, e.g. held pedals)
+		out->streamNotesOff(0);
+		m_jumped = false;
+	}
+
+	for (int i = 0; i < m_tracks.size() && i < m_song->tracks.size(); i++)
+		m_tracks[i].renderRow(m_song->tracks[i], m_order, m_row, 0, m_events);
+
+	for (const SongEvent &event : m_events)
+		event.play(0, m_song->instruments, out);
+
+	if (++m_row >= m_song->rows())
+	{
+		m_row = 0;
+		if (++m_order >= m_song->length())
+		{
+			m_order = 0;
+			m_jumped = true;
+		}
+	}
+}
@@ -0,0 +1,122 @@
+/*
+ * Song playback engine.
+ *
+ * The sequencer plays a song on an output device in stream mode. Each time the device asks for
+ * more data (MIDIOutput::streamReady()), the next few rows of the song are rendered into the
+ * stream through the song's instruments, then the buffer is flushed.
+ *
+ * All rendering happens on the sequencer's own thread, so playback doesn't depend on the GUI
+ * thread keeping up. The song's cells can be edited while it's playing, but tracks, patterns
+ * and the number of rows must not be added or removed until playback is stopped.
+ */
+
+#ifndef SEQUENCER_H
+#define SEQUENCER_H
+
+#include <QMutex>
+#include <QObject>
+#include <QVector>
+
+struct Instrument;
+class MIDIOutput;
+class MIDISink;
+class QThread;
+class Song;
+class Track;
+
+/*
+ * Something a track does at a particular time, as far as its instrument is concerned.
+ */
+struct SongEvent
+{
+	enum Type
+	{
+		NoteOff,
+		NoteOn,
+		Macro
+	};
+
+	// time in ticks (from whatever point the owner of the event wants)
+	quint32 time;
+	quint8 type;
+	quint8 instrument;
+	// note and velocity, or macro number in place of the velocity
+	quint8 note, value;
+	quint16 param;
+
+	// play this event on an instrument from a song's list of instruments
+	void play(int time, Instrument *instruments, MIDISink *out) const;
+};
+
+Q_DECLARE_TYPEINFO(SongEvent, Q_PRIMITIVE_TYPE);
+
+/*
+ * Turns a track's rows into events, keeping track of which instrument and note it's playing.
+ */
+class TrackPlayer
+{
+public:
+	void reset()
+	{
+		m_instrument = m_note = -1;
+	}
+
+	// add the events for one row of a track, at a given time
+	void renderRow(const Track &track, uint order, uint row, quint32 time,
+				   QVector<SongEvent> &events);
+	// add a note off for the note which is still playing, if there is one
+	void release(quint32 time, QVector<SongEvent> &events);
+
+private:
+	int m_instrument = -1;
+	int m_note = -1;
+};
+
+class Sequencer : public QObject
+{
+	Q_OBJECT
+
+public:
+	explicit Sequencer(Song *song = 0);
+	~Sequencer();
+
+	void setSong(Song *song);
+
+	/* Set how much of the song is rendered each time the output device asks for more data.
+	 * \param ticks the minimum number of ticks to render (at 96 ticks per quarter note)
+	 */
+	void setLookahead(uint ticks);
+
+	/* Start playing the song from the beginning on an output device (which must already be
+	 * opened in stream mode), or continue playing after pause().
+	 * \returns whether or not the stream was started successfully
+	 */
+	bool play(MIDIOutput *out);
+	void pause();
+	void stop();
+
+	bool isPlaying() const { return m_output && !m_paused; }
+
+private slots:
+	void render();
+
+private:
+	void reset();
+	void renderRow(MIDISink *out);
+
+	QThread *m_thread;
+	QMutex m_lock;
+
+	Song *m_song;
+	MIDIOutput *m_output;
+	bool m_paused;
+
+	uint m_lookahead;
+	uint m_order, m_row;
+	// whether the next row doesn't follow the last one (e.g. the song looped)
+	bool m_jumped;
+	QVector<TrackPlayer> m_tracks;
+	QVector<SongEvent> m_events;
+};
+
+#endif // SEQUENCER_H
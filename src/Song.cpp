@@ -0,0 +1,194 @@
+#include "Song.h"
+
+#include <cstring>
+
+// ------------------------------------------------------------------------------------------------
+Track::Track(uint rows)
+	: m_rows(rows)
+	, m_patterns(0)
+	, m_effectColumns(1)
+{
+}
+
+// ------------------------------------------------------------------------------------------------
+void Track::setEffectColumns(uint columns)
+{
+	columns = qMin(columns, (uint)MAX_EFFECT_COLUMNS);
+
+	for (uint i = 0; i < MAX_EFFECT_COLUMNS; i++)
+	{
+		if (i < columns)
+		{
+			m_effect[i].resize(m_rows * m_patterns);
+			m_param[i].resize(m_rows * m_patterns);
+		}
+		else
+		{
+			// removed columns don't take up any space
+			m_effect[i] = QVector<quint8>();
+			m_param[i] = QVector<quint16>();
+		}
+	}
+
+	m_effectColumns = columns;
+}
+
+// ------------------------------------------------------------------------------------------------
+uint Track::addPattern()
+{
+	uint size = m_rows * (m_patterns + 1);
+
+	m_note.resize(size);
+	m_instrument.resize(size);
+	m_volume.resize(size);
+	for (uint i = 0; i < m_effectColumns; i++)
+	{
+		m_effect[i].resize(size);
+		m_param[i].resize(size);
+	}
+
+	this->clearPattern(m_patterns);
+	return m_patterns++;
+}
+
+// ------------------------------------------------------------------------------------------------
+SongCell Track::cell(uint pattern, uint row) const
+{
+	SongCell cell;
+	if (pattern >= m_patterns || row >= m_rows) return cell;
+
+	uint pos = pattern * m_rows + row;
+
+	cell.note = m_note[pos];
+	cell.instrument = m_instrument[pos];
+	cell.volume = m_volume[pos];
+	for (uint i = 0; i < m_effectColumns; i++)
+	{
+		cell.effect[i] = m_effect[i][pos];
+		cell.param[i] = m_param[i][pos];
+	}
+
+	return cell;
+}
+
+// ------------------------------------------------------------------------------------------------
+void Track::setCell(uint pattern, uint row, const SongCell &cell)
+{
+	if (pattern >= m_patterns || row >= m_rows) return;
+
+	uint pos = pattern * m_rows + row;
+
+	m_note[pos] = cell.note;
+	m_instrument[pos] = cell.instrument;
+	m_volume[pos] = cell.volume;
+	for (uint i = 0; i < m_effectColumns; i++)
+	{
+		m_effect[i][pos] = cell.effect[i];
+		m_param[i][pos] = cell.param[i];
+	}
+}
+
+// ------------------------------------------------------------------------------------------------
+void Track::clearPattern(uint pattern)
+{
+	if ((pattern + 1) * m_rows > (uint)m_note.size()) return;
+
+	uint start = pattern * m_rows;
+
+	memset(m_note.data() + start, SongCell::NoteNone, m_rows);
+	memset(m_instrument.data() + start, SongCell::InstrumentNone, m_rows);
+	memset(m_volume.data() + start, SongCell::VolumeNone, m_rows);
+	for (uint i = 0; i < m_effectColumns; i++)
+	{
+		memset(m_effect[i].data() + start, SongCell::EffectNone, m_rows);
+		memset(m_param[i].data() + start, 0, m_rows * sizeof(quint16));
+	}
+}
+
+// ------------------------------------------------------------------------------------------------
+PatternView Track::pattern(uint pattern) const
+{
+	PatternView view = {};
+	if (pattern >= m_patterns) return view;
+
+	uint start = pattern * m_rows;
+
+	view.rows = m_rows;
+	view.note = m_note.constData() + start;
+	view.instrument = m_instrument.constData() + start;
+	view.volume = m_volume.constData() + start;
+	for (uint i = 0; i < m_effectColumns; i++)
+	{
+		view.effect[i] = m_effect[i].constData() + start;
+		view.param[i] = m_param[i].constData() + start;
+	}
+
+	return view;
+}
+
+// ------------------------------------------------------------------------------------------------
+uint Track::dataSize() const
+{
+	return m_rows * m_patterns * (3 + m_effectColumns * (sizeof(quint8) + sizeof(quint16)));
+}
+
+// ------------------------------------------------------------------------------------------------
+void Track::setRows(uint rows)
+{
+	if (rows == m_rows) return;
+
+	// copy each pattern into its new place, cutting it off or adding empty rows at the end
+	Track track(rows);
+	track.name = name;
+	track.orders = orders;
+	track.setEffectColumns(m_effectColumns);
+
+	const uint keep = qMin(rows, m_rows);
+
+	for (uint i = 0; i < m_patterns; i++)
+	{
+		track.addPattern();
+
+		for (uint row = 0; row < keep; row++)
+			track.setCell(i, row, this->cell(i, row));
+	}
+
+	*this = track;
+}
+
+// ------------------------------------------------------------------------------------------------
+Song::Song(uint tracks, uint rows)
+	: m_rows(rows)
+{
+	for (uint i = 0; i < tracks; i++)
+		this->addTrack();
+}
+
+// ------------------------------------------------------------------------------------------------
+void Song::setRows(uint rows)
+{
+	if (!rows) return;
+
+	for (Track &track : tracks)
+		track.setRows(rows);
+
+	m_rows = rows;
+}
+
+// ------------------------------------------------------------------------------------------------
+Track& Song::addTrack()
+{
+	tracks.append(Track(m_rows));
+	return tracks.last();
+}
+
+// ------------------------------------------------------------------------------------------------
+uint Song::length() const
+{
+	uint length = 0;
+
+	for (const Track &track : tracks)
+		length = qMax(length, (uint)track.orders.size());
+
+	return length;
+}
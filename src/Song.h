@@ -0,0 +1,127 @@
+/*
+ * Song and pattern data.
+ *
+ * A song is a set of tracks, each with its own list of patterns and its own order list
+ * (the sequence of patterns it plays, like in GoatTracker). All patterns in a song have the
+ * same number of rows.
+ *
+ * Pattern data is stored per track as one array per column (notes, instruments, volumes, and
+ * each effect column), with all of a track's patterns one after another. Walking through the
+ * rows of a pattern (see Track::pattern()) is just walking through a few flat arrays, and an
+ * empty cell only takes up as many bytes as the track has columns.
+ */
+
+#ifndef SONG_H
+#define SONG_H
+
+#include <QString>
+#include <QVector>
+
+#include "Instrument.h"
+
+#define MAX_EFFECT_COLUMNS 4
+
+/*
+ * A single cell of a pattern, for editing. (This isn't how cells are actually stored.)
+ */
+struct SongCell
+{
+	enum
+	{
+		NoteNone = 0,     // note values 1-128 are MIDI notes 0-127
+		NoteOff  = 0xFF,
+		InstrumentNone = 0xFF,
+		VolumeNone = 0xFF,
+		EffectNone = 0
+	};
+
+	quint8 note = NoteNone;
+	quint8 instrument = InstrumentNone;
+	quint8 volume = VolumeNone;
+	quint8 effect[MAX_EFFECT_COLUMNS] = {};
+	quint16 param[MAX_EFFECT_COLUMNS] = {};
+};
+
+/*
+ * Read-only view of the rows of one pattern.
+ * Effect columns the track doesn't have are null.
+ */
+struct PatternView
+{
+	uint rows;
+
+	const quint8 *note;
+	const quint8 *instrument;
+	const quint8 *volume;
+	const quint8 *effect[MAX_EFFECT_COLUMNS];
+	const quint16 *param[MAX_EFFECT_COLUMNS];
+};
+
+class Track
+{
+public:
+	explicit Track(uint rows = 64);
+
+	QString name;
+
+	// the patterns this track plays, in order
+	QVector<quint16> orders;
+
+	uint rows() const { return m_rows; }
+	uint patternCount() const { return m_patterns; }
+
+	uint effectColumns() const { return m_effectColumns; }
+	void setEffectColumns(uint columns);
+
+	/* Add a new (empty) pattern.
+	 * \returns the new pattern's number
+	 */
+	uint addPattern();
+
+	SongCell cell(uint pattern, uint row) const;
+	void setCell(uint pattern, uint row, const SongCell &cell);
+	void clearPattern(uint pattern);
+
+	PatternView pattern(uint pattern) const;
+
+	// number of bytes used by pattern data
+	uint dataSize() const;
+
+	// (called by Song when changing the number of rows in every pattern)
+	void setRows(uint rows);
+
+private:
+	uint m_rows, m_patterns, m_effectColumns;
+
+	QVector<quint8> m_note, m_instrument, m_volume;
+	QVector<quint8> m_effect[MAX_EFFECT_COLUMNS];
+	QVector<quint16> m_param[MAX_EFFECT_COLUMNS];
+};
+
+class Song
+{
+public:
+	explicit Song(uint tracks = 0, uint rows = 64);
+
+	QString name;
+
+	// initial tempo, and number of ticks per pattern row at 96 ticks per quarter note
+	double tempo = 120.0;
+	uint ticksPerRow = 24;
+
+	QVector<Track> tracks;
+	Instrument instruments[64];
+
+	uint rows() const { return m_rows; }
+	void setRows(uint rows);
+
+	Track& addTrack();
+
+	// the length of the song (the length of the longest order list)
+	uint length() const;
+
+private:
+	uint m_rows;
+};
+
+#endif // SONG_H
@@ -3,14 +3,23 @@
 #
 
 SOURCES += \
+    $$PWD/MIDIchannels.cpp \
     $$PWD/MIDIdefs.cpp \
+    $$PWD/MIDIfile.cpp \
+    $$PWD/MIDIinput.cpp \
     $$PWD/MIDIoutput.cpp
 
 HEADERS += \
     $$PWD/MIDIinput.h \
     $$PWD/MIDIoutput.h \
+    $$PWD/MIDIchannels.h \
+    $$PWD/MIDImessage.h \
+    $$PWD/MIDIstream.h \
+    $$PWD/MIDIsink.h \
+    $$PWD/MIDIfile.h \
     $$PWD/MIDIdevice.h \
-    $$PWD/MIDIdefs.h
+    $$PWD/MIDIdefs.h \
+    $$PWD/RingBuffer.h
 
 win32 {
     message(building with WinMM)
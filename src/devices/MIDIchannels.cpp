@@ -0,0 +1,120 @@
+#include "MIDIchannels.h"
+
+// ------------------------------------------------------------------------------------------------
+int MIDIChannelState::allocate(const void *owner, int fixed, quint8 program, quint8 bank, quint8 bankLSB)
+{
+	QMutexLocker lock(&m_lock);
+
+	int best = -1;
+	uint bestCost = 0;
+
+	if (fixed >= 0)
+	{
+		best = fixed & 0xF;
+	}
+	else for (int i = 0; i < 16; i++)
+	{
+		if (reserved(i)) continue;
+
+		const MIDIChannel &channel = m_channels[i];
+		if (channel.owner == owner)
+		{
+			best = i;
+			break;
+		}
+
+		// taking a channel from someone else costs more than setting up a different sound
+		// and cutting off notes that are still playing costs more than either
+		uint cost = 0;
+		if (channel.hasNotes() || channel.sustain)
+			cost += 4;
+		if (channel.owner)
+			cost += 2;
+		if (!channel.valid || channel.program != program
+				|| channel.bank != bank || channel.bankLSB != bankLSB)
+			cost += 1;
+
+		if (best < 0 || cost < bestCost
+				|| (cost == bestCost && m_lastUsed[i] < m_lastUsed[best]))
+		{
+			best = i;
+			bestCost = cost;
+		}
+	}
+
+	if (best >= 0)
+		m_lastUsed[best] = ++m_clock;
+
+	return best;
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIChannelState::setReserved(uint channel, bool reserved)
+{
+	QMutexLocker lock(&m_lock);
+
+	if (reserved)
+		m_reserved |= (1 << (channel & 0xF));
+	else
+		m_reserved &= ~(1 << (channel & 0xF));
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIChannelState::trackNote(const void *owner, MIDIMessage message)
+{
+	QMutexLocker lock(&m_lock);
+
+	MIDIChannel &channel = m_channels[message.channel()];
+	const quint8 data1 = message.data1();
+	const quint8 data2 = message.data2();
+
+	switch (message.type())
+	{
+	case MIDIMessage::NoteOn:
+		if (!data2)
+			channel.clearNote(data1);
+		else if (owner)
+			channel.setNote(data1, owner);
+		break;
+
+	case MIDIMessage::NoteOff:
+		channel.clearNote(data1);
+		break;
+
+	case MIDIMessage::Control:
+		if (data1 == CC_HOLD_PEDAL)
+			channel.sustain = data2 >= 64;
+		else if (data1 == CC_ALL_SOUND_OFF || data1 == CC_ALL_NOTES_OFF)
+			channel.clearNotes();
+		else if (data1 == CC_ALL_CONTROLLERS_OFF)
+			channel.sustain = false;
+		break;
+	}
+}
+
+// ------------------------------------------------------------------------------------------------
+int MIDIChannelState::findNote(const void *owner, quint8 note) const
+{
+	QMutexLocker lock(&m_lock);
+
+	for (int i = 0; i < 16; i++)
+	{
+		const MIDIChannel &channel = m_channels[i];
+		if (channel.isPlaying(note) && channel.noteOwners[note & 0x7F] == owner)
+			return i;
+	}
+
+	return -1;
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIChannelState::forgetNotes()
+{
+	QMutexLocker lock(&m_lock);
+
+	for (MIDIChannel &channel : m_channels)
+	{
+		channel.clearNotes();
+		channel.sustain = false;
+	}
+}
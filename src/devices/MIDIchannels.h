@@ -0,0 +1,210 @@
+/*
+ * Shadow state of the MIDI channels of an output device.
+ *
+ * Each MIDIOutput owns one of these (see MIDIOutput::channels()). It keeps track of who last set
+ * up each channel (e.g. an instrument) and what was sent to it, so that a channel doesn't have to
+ * be set up from scratch every time it changes hands. The state is forgotten whenever the device
+ * is opened or reset.
+ *
+ * It also hands out channels to owners which don't need a particular one (see allocate()).
+ *
+ * The state may be used from any thread, but must only be accessed while holding the lock
+ * (which is recursive, and is also held by the device while it forgets the state).
+ */
+
+#ifndef MIDICHANNELS_H
+#define MIDICHANNELS_H
+
+#include "MIDImessage.h"
+#include <QMutex>
+#include <cstring>
+
+// (QMutex::Recursive is deprecated as of Qt 5.14, which has a separate class instead)
+#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
+#include <QRecursiveMutex>
+typedef QRecursiveMutex RecursiveMutex;
+#else
+class RecursiveMutex : public QMutex
+{
+public:
+	RecursiveMutex()
+		: QMutex(QMutex::Recursive)
+	{
+	}
+};
+#endif
+
+struct MIDIChannel
+{
+	enum
+	{
+		// value of a controller which hasn't been set
+		CONTROL_UNKNOWN = 0xFF,
+		// how many NRPN values are remembered at once
+		NRPN_COUNT = 16
+	};
+
+	MIDIChannel()
+	{
+		resetControls();
+	}
+
+	// whoever last set up the channel
+	const void *owner = nullptr;
+
+	// whether the rest of this is actually known yet
+	bool valid = false;
+	// whether the channel may have been changed from somewhere else (e.g. MIDI thru)
+	bool external = false;
+
+	quint8 program, bank, bankLSB;
+	quint16 bendRange, tune, fineTune;
+	quint16 pitch;
+
+	// controller values which have been set since the last controller reset
+	// (these are plain arrays, since they're updated for every message an instrument sends)
+	quint8 controls[128];
+	// the most recently set NRPN values (oldest first)
+	struct NRPN
+	{
+		quint16 param, value;
+	};
+	NRPN nrpns[NRPN_COUNT];
+	uint nrpnCount = 0;
+
+	// notes which are still playing (and whoever played them), and whether the pedal is held
+	// (unlike the rest, this is kept up to date even when the channel isn't valid)
+	quint64 notes[2] = {};
+	const void *noteOwners[128] = {};
+	bool sustain = false;
+
+	void resetControls()
+	{
+		memset(controls, CONTROL_UNKNOWN, sizeof(controls));
+	}
+
+	/* \returns the value an NRPN was last set to, or -1 if it isn't known
+	 */
+	int nrpn(quint16 param) const
+	{
+		for (uint i = 0; i < nrpnCount; i++)
+		{
+			if (nrpns[i].param == param)
+				return nrpns[i].value;
+		}
+		return -1;
+	}
+	/* Remember an NRPN value (forgetting the oldest one if there are too many).
+	 */
+	void setNRPN(quint16 param, quint16 value)
+	{
+		for (uint i = 0; i < nrpnCount; i++)
+		{
+			if (nrpns[i].param == param)
+			{
+				nrpns[i].value = value;
+				return;
+			}
+		}
+
+		if (nrpnCount == NRPN_COUNT)
+			memmove(nrpns, nrpns + 1, sizeof(NRPN) * --nrpnCount);
+		nrpns[nrpnCount++] = {param, value};
+	}
+
+	bool isPlaying(quint8 note) const
+	{
+		return notes[(note >> 6) & 1] & (1ull << (note & 63));
+	}
+	bool hasNotes() const
+	{
+		return notes[0] || notes[1];
+	}
+	void setNote(quint8 note, const void *owner)
+	{
+		notes[(note >> 6) & 1] |= 1ull << (note & 63);
+		noteOwners[note & 0x7F] = owner;
+	}
+	void clearNote(quint8 note)
+	{
+		notes[(note >> 6) & 1] &= ~(1ull << (note & 63));
+	}
+	void clearNotes()
+	{
+		notes[0] = notes[1] = 0;
+	}
+};
+
+class MIDIChannelState
+{
+public:
+	MIDIChannelState()
+		: m_reserved(1 << 9) // GM drums
+		, m_clock(0)
+		, m_lastUsed()
+	{
+	}
+
+	RecursiveMutex* lock()
+	{
+		return &m_lock;
+	}
+
+	MIDIChannel& operator[](uint channel)
+	{
+		return m_channels[channel & 0xF];
+	}
+
+	void clear()
+	{
+		QMutexLocker lock(&m_lock);
+
+		for (MIDIChannel &channel : m_channels)
+		{
+			channel = MIDIChannel();
+		}
+	}
+
+	/* Pick a channel for an owner to use, and mark it as just used.
+	 * If the owner already has a channel, it keeps it. Otherwise, this prefers channels that
+	 * nobody owns, then channels already set to the same bank and program, and then the ones
+	 * which have gone unused the longest. Channels with notes still playing (or the sustain
+	 * pedal held) are only taken if there's nothing else. Reserved channels are never picked.
+	 * The owner still has to set up the channel (and take ownership of it) if it's a new one.
+	 * \param fixed a specific channel to use instead (may be reserved), or -1 to pick one
+	 * \returns the channel to use, or -1 if every channel is reserved
+	 */
+	int allocate(const void *owner, int fixed, quint8 program, quint8 bank, quint8 bankLSB);
+
+	/* Keep a channel from being picked by allocate(), or make it available again.
+	 * By default, only channel 10 (for drums) is reserved.
+	 */
+	void setReserved(uint channel, bool reserved = true);
+	bool reserved(uint channel) const
+	{
+		return m_reserved & (1 << (channel & 0xF));
+	}
+
+	/* Keep track of the notes and sustain pedal on a channel from a message sent to it.
+	 * Notes are remembered along with the owner that played them, so that they can still be
+	 * released on the same channel after it changes hands (see findNote()). If the owner is null,
+	 * only releases are tracked.
+	 */
+	void trackNote(const void *owner, MIDIMessage message);
+	/* \returns the channel where an owner is still playing a note, or -1 if it isn't
+	 */
+	int findNote(const void *owner, quint8 note) const;
+	/* Forget about all playing notes and held pedals, e.g. after the device released them.
+	 */
+	void forgetNotes();
+
+private:
+	mutable RecursiveMutex m_lock;
+	MIDIChannel m_channels[16];
+
+	quint16 m_reserved;
+	// when each channel was last handed out (this isn't forgotten along with the rest)
+	quint64 m_clock, m_lastUsed[16];
+};
+
+#endif // MIDICHANNELS_H
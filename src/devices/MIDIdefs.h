@@ -1,20 +1,21 @@
 #ifndef MIDIDEFS_H
 #define MIDIDEFS_H
 
-#define MIDI_LSB(n)         (n & 0x7F)
-#define MIDI_MSB(n)         ((n >> 7) & 0x7F)
-#define MIDI_WORD(m, l)     ((m << 7) | (l & 0x7F))
+#define MIDI_LSB(n)         ((n) & 0x7F)
+#define MIDI_MSB(n)         (((n) >> 7) & 0x7F)
+#define MIDI_WORD(m, l)     (((m) << 7) | ((l) & 0x7F))
 
 /*
- * MIDI event/status bytes
+ * MIDI event/status bytes, as they appear in raw MIDI data (short messages are checked against
+ * MIDIMessage::Type instead, see MIDImessage.h)
  */
-#define EVENT_NOTEOFF(c)    (0x80 | c)
-#define EVENT_NOTEON(c)     (0x90 | c)
-#define EVENT_AFTERTOUCH(c) (0xA0 | c)
-#define EVENT_CONTROL(c)    (0xB0 | c)
-#define EVENT_PROGRAM(c)    (0xC0 | c)
-#define EVENT_PRESSURE(c)   (0xD0 | c)
-#define EVENT_PITCH(c)      (0xE0 | c)
+#define EVENT_NOTEOFF(c)    (0x80 | (c))
+#define EVENT_NOTEON(c)     (0x90 | (c))
+#define EVENT_AFTERTOUCH(c) (0xA0 | (c))
+#define EVENT_CONTROL(c)    (0xB0 | (c))
+#define EVENT_PROGRAM(c)    (0xC0 | (c))
+#define EVENT_PRESSURE(c)   (0xD0 | (c))
+#define EVENT_PITCH(c)      (0xE0 | (c))
 
 #define EVENT_SYSEX_START   0xF0
 #define EVENT_SYSEX_END     0xF7
@@ -32,11 +33,6 @@
 #define EVENT_ACTIVE_SENSE  0xFE
 #define EVENT_RESET         0xFF
 
-/*
- * Reroute a MIDI event to a different channel
- */
-#define EVENT_REROUTE(e, c) ((e < 0xF0) ? (e & 0xF0) | c : e)
-
 /*
  * MIDI control values
  */
@@ -0,0 +1,570 @@
+#include "MIDIfile.h"
+
+#include <QFile>
+#include <QObject>
+
+#include <algorithm>
+
+// how much data is written to the file at once
+#define MIDIFILE_BUFFER_SIZE 65536
+
+// ------------------------------------------------------------------------------------------------
+MIDIFileWriter::MIDIFileWriter(uint ppq)
+	: m_file(nullptr)
+	, m_ppq(qBound(1u, ppq, 0x7FFFu))
+	, m_format(0)
+	, m_tracks(0)
+	, m_trackStart(0)
+	, m_trackSize(0)
+	, m_pending(0)
+	, m_runningStatus(0)
+{
+}
+
+// ------------------------------------------------------------------------------------------------
+MIDIFileWriter::~MIDIFileWriter()
+{
+	this->close();
+}
+
+// ------------------------------------------------------------------------------------------------
+bool MIDIFileWriter::open(const QString &fileName, uint format)
+{
+	this->close();
+
+	m_error = QString();
+	m_file = new QFile(fileName);
+	if (!m_file->open(QIODevice::WriteOnly))
+	{
+		m_error = m_file->errorString();
+		delete m_file;
+		m_file = nullptr;
+		return false;
+	}
+
+	m_buffer.reserve(MIDIFILE_BUFFER_SIZE);
+	m_buffer.resize(0);
+	m_channels.clear();
+	m_format = format ? 1 : 0;
+	m_tracks = 0;
+
+	// header (the number of tracks is filled in when the file is closed)
+	this->write("MThd\0\0\0\x06", 8);
+	this->write(0);
+	this->write(m_format);
+	this->write(0);
+	this->write(0);
+	this->write(m_ppq >> 8);
+	this->write(m_ppq & 0xFF);
+
+	this->beginTrack();
+	return true;
+}
+
+// ------------------------------------------------------------------------------------------------
+bool MIDIFileWriter::newTrack()
+{
+	if (!m_file) return false;
+
+	if (m_format)
+	{
+		this->endTrack();
+		this->beginTrack();
+	}
+
+	return m_error.isEmpty();
+}
+
+// ------------------------------------------------------------------------------------------------
+bool MIDIFileWriter::close()
+{
+	if (!m_file) return false;
+
+	this->endTrack();
+	this->flush();
+	this->writeAt(10, m_tracks, 2);
+
+	m_file->close();
+	delete m_file;
+	m_file = nullptr;
+
+	return m_error.isEmpty();
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIFileWriter::streamSend(uint time, MIDIMessage message)
+{
+	if (!message.isChannelMessage())
+	{
+		this->streamDelay(time);
+		return;
+	}
+
+	this->writeDelta(time);
+
+	if (message.status() != m_runningStatus)
+	{
+		m_runningStatus = message.status();
+		this->write(m_runningStatus);
+	}
+
+	this->write(message.data1() & 0x7F);
+	if (message.type() != MIDIMessage::Program && message.type() != MIDIMessage::Pressure)
+		this->write(message.data2() & 0x7F);
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIFileWriter::streamSend(uint time, const QByteArray &data)
+{
+	if (data.isEmpty())
+	{
+		this->streamDelay(time);
+		return;
+	}
+
+	this->writeDelta(time);
+	m_runningStatus = 0;
+
+	if ((quint8)data[0] == 0xF0)
+	{
+		this->write(0xF0);
+		this->writeNumber(data.size() - 1);
+		this->write(data.constData() + 1, data.size() - 1);
+	}
+	else
+	{
+		this->write(0xF7);
+		this->writeNumber(data.size());
+		this->write(data.constData(), data.size());
+	}
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIFileWriter::streamSetTempo(uint time, double bpm)
+{
+	// ignore tempos that are too low
+	uint tempo = bpm > 0 ? (60 * 1000000) / bpm : 0;
+	if (!tempo || tempo >= (1 << 24))
+	{
+		this->streamDelay(time);
+		return;
+	}
+
+	this->writeDelta(time);
+	m_runningStatus = 0;
+
+	const char event[] = {
+		'\xFF', 0x51, 0x03,
+		(char)(tempo >> 16), (char)(tempo >> 8), (char)tempo
+	};
+	this->write(event, sizeof(event));
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIFileWriter::streamDelay(uint time)
+{
+	m_pending += time;
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIFileWriter::beginTrack()
+{
+	// (the length is filled in when the track ends)
+	m_trackStart = m_file->pos() + m_buffer.size();
+	this->write("MTrk\0\0\0\0", 8);
+
+	m_trackSize = 0;
+	m_pending = 0;
+	m_runningStatus = 0;
+	m_tracks++;
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIFileWriter::endTrack()
+{
+	this->writeDelta(0);
+	this->write("\xFF\x2F\x00", 3);
+
+	const quint32 size = m_trackSize;
+
+	if (m_trackStart >= m_file->pos())
+	{
+		// the whole track is still in the buffer
+		const qint64 pos = m_trackStart - m_file->pos() + 4;
+		for (uint i = 0; i < 4; i++)
+			m_buffer[int(pos + i)] = (char)(size >> (24 - 8 * i));
+	}
+	else
+	{
+		this->flush();
+		this->writeAt(m_trackStart + 4, size, 4);
+	}
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIFileWriter::writeDelta(uint time)
+{
+	this->writeNumber(m_pending + time);
+	m_pending = 0;
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIFileWriter::writeNumber(quint32 value)
+{
+	// variable-length number, most significant 7 bits first
+	char bytes[5];
+	uint size = 0;
+
+	value &= 0x0FFFFFFF;
+	do
+	{
+		bytes[4 - size] = (value & 0x7F) | (size ? 0x80 : 0);
+		value >>= 7;
+		size++;
+	}
+	while (value);
+
+	this->write(bytes + 5 - size, size);
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIFileWriter::write(const char *data, uint size)
+{
+	if (!m_file) return;
+
+	m_trackSize += size;
+
+	if (m_buffer.size() + size > MIDIFILE_BUFFER_SIZE)
+	{
+		this->flush();
+
+		// (don't bother buffering anything that wouldn't fit anyway)
+		if (size > MIDIFILE_BUFFER_SIZE)
+		{
+			if (m_file->write(data, size) != (qint64)size && m_error.isEmpty())
+				m_error = m_file->errorString();
+			return;
+		}
+	}
+
+	m_buffer.append(data, size);
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIFileWriter::writeAt(qint64 pos, quint32 value, uint size)
+{
+	// (the buffer must be flushed first)
+	char bytes[4];
+	for (uint i = 0; i < size; i++)
+		bytes[i] = (char)(value >> (8 * (size - 1 - i)));
+
+	const qint64 end = m_file->pos();
+	if (!m_file->seek(pos) || m_file->write(bytes, size) != (qint64)size || !m_file->seek(end))
+	{
+		if (m_error.isEmpty())
+			m_error = m_file->errorString();
+	}
+}
+
+// ------------------------------------------------------------------------------------------------
+bool MIDIFileWriter::flush()
+{
+	if (m_buffer.isEmpty()) return true;
+
+	bool ok = m_file->write(m_buffer.constData(), m_buffer.size()) == (qint64)m_buffer.size();
+	if (!ok && m_error.isEmpty())
+		m_error = m_file->errorString();
+
+	// (this doesn't free the memory)
+	m_buffer.resize(0);
+	return ok;
+}
+
+// ------------------------------------------------------------------------------------------------
+MIDIFileTrack::MIDIFileTrack(const uchar *data, quint32 size)
+	: m_pos(data)
+	, m_end(data + size)
+	, m_runningStatus(0)
+	, m_event()
+{
+}
+
+// ------------------------------------------------------------------------------------------------
+bool MIDIFileTrack::readNumber(quint32 &value)
+{
+	// variable-length number, at most 4 bytes
+	value = 0;
+	for (uint i = 0; i < 4 && m_pos < m_end; i++)
+	{
+		const uchar byte = *m_pos++;
+		value = (value << 7) | (byte & 0x7F);
+		if (!(byte & 0x80))
+			return true;
+	}
+
+	return false;
+}
+
+// ------------------------------------------------------------------------------------------------
+bool MIDIFileTrack::next()
+{
+	quint32 delta;
+	if (!readNumber(delta) || m_pos >= m_end)
+	{
+		m_pos = m_end;
+		return false;
+	}
+
+	m_event.time += delta;
+	m_event.metaType = 0;
+
+	quint8 status = *m_pos;
+	if (status & 0x80)
+		m_pos++;
+	else
+		status = m_runningStatus;
+
+	m_event.status = status;
+
+	if (status >= 0x80 && status < 0xF0)
+	{
+		// channel message
+		// (SysEx and meta events are supposed to cancel running status, but some files
+		// don't expect them to, and a file which does can't be read differently this way)
+		m_runningStatus = status;
+		m_event.size = (status & 0xE0) == 0xC0 ? 1 : 2;
+	}
+	else if (status == 0xF0 || status == 0xF7)
+	{
+		if (!readNumber(m_event.size))
+		{
+			m_pos = m_end;
+			return false;
+		}
+	}
+	else if (status == 0xFF && m_pos < m_end)
+	{
+		m_event.metaType = *m_pos++;
+		if (!readNumber(m_event.size) || m_event.metaType == 0x2F)
+		{
+			// end of track
+			m_pos = m_end;
+			return false;
+		}
+	}
+	else
+	{
+		// not a valid event (or no running status to use)
+		m_pos = m_end;
+		return false;
+	}
+
+	if (m_event.size > quint32(m_end - m_pos))
+	{
+		m_pos = m_end;
+		return false;
+	}
+
+	m_event.data = m_pos;
+	m_pos += m_event.size;
+	return true;
+}
+
+// ------------------------------------------------------------------------------------------------
+MIDIFileReader::MIDIFileReader()
+	: m_file(nullptr)
+	, m_data(nullptr)
+	, m_size(0)
+	, m_format(0)
+	, m_ppq(0)
+{
+}
+
+// ------------------------------------------------------------------------------------------------
+MIDIFileReader::~MIDIFileReader()
+{
+	this->close();
+}
+
+// ------------------------------------------------------------------------------------------------
+bool MIDIFileReader::open(const QString &fileName)
+{
+	this->close();
+
+	m_error = QString();
+	m_file = new QFile(fileName);
+	if (!m_file->open(QIODevice::ReadOnly)
+			|| !(m_size = m_file->size())
+			|| !(m_data = m_file->map(0, m_size)))
+	{
+		m_error = m_file->errorString();
+		this->close();
+		return false;
+	}
+
+	// (each byte is widened first, since shifting a byte of 0x80 or more into the sign bit of
+	// an int is undefined)
+	auto read16 = [this](qint64 pos) -> quint32
+	{
+		return ((quint32)m_data[pos] << 8) | (quint32)m_data[pos + 1];
+	};
+	auto read32 = [this](qint64 pos) -> quint32
+	{
+		return ((quint32)m_data[pos] << 24) | ((quint32)m_data[pos + 1] << 16)
+			| ((quint32)m_data[pos + 2] << 8) | (quint32)m_data[pos + 3];
+	};
+
+	if (m_size < 14 || memcmp(m_data, "MThd", 4) || read32(4) < 6)
+	{
+		m_error = QObject::tr("not a MIDI file");
+		this->close();
+		return false;
+	}
+
+	m_format = read16(8);
+	m_ppq = read16(12);
+	if (m_ppq & 0x8000)
+	{
+		m_error = QObject::tr("SMPTE timing is not supported");
+		this->close();
+		return false;
+	}
+
+	// find the tracks, skipping any other chunks
+	// (a track which runs past the end of the file just ends early)
+	qint64 pos = 8 + read32(4);
+	while (pos + 8 <= m_size)
+	{
+		const quint32 size = read32(pos + 4);
+
+		if (!memcmp(m_data + pos, "MTrk", 4))
+		{
+			Chunk chunk;
+			chunk.start = pos + 8;
+			chunk.size = qMin<qint64>(size, m_size - chunk.start);
+			m_tracks.append(chunk);
+		}
+
+		pos += 8 + (qint64)size;
+	}
+
+	return true;
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIFileReader::close()
+{
+	if (m_file)
+	{
+		if (m_data)
+			m_file->unmap(const_cast<uchar*>(m_data));
+		m_file->close();
+		delete m_file;
+	}
+
+	m_file = nullptr;
+	m_data = nullptr;
+	m_size = 0;
+	m_format = m_ppq = 0;
+	m_tracks.clear();
+}
+
+// ------------------------------------------------------------------------------------------------
+MIDIFileTrack MIDIFileReader::track(uint track) const
+{
+	if (track >= (uint)m_tracks.size())
+		return MIDIFileTrack();
+
+	return MIDIFileTrack(m_data + m_tracks[track].start, m_tracks[track].size);
+}
+
+// ------------------------------------------------------------------------------------------------
+MIDIFileMerger::MIDIFileMerger(const MIDIFileReader &file)
+	: m_event()
+	, m_track(0)
+	, m_time(0)
+{
+	for (uint i = 0; i < file.trackCount(); i++)
+	{
+		m_tracks.append(file.track(i));
+		this->push(i);
+	}
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIFileMerger::push(uint track)
+{
+	// read the track's next event and put it in line
+	if (!m_tracks[track].next()) return;
+
+	Head head = {m_tracks[track].event().time, track};
+	m_heap.append(head);
+	std::push_heap(m_heap.begin(), m_heap.end());
+}
+
+// ------------------------------------------------------------------------------------------------
+bool MIDIFileMerger::next()
+{
+	if (m_heap.isEmpty()) return false;
+
+	std::pop_heap(m_heap.begin(), m_heap.end());
+	m_track = m_heap.last().track;
+	m_heap.removeLast();
+
+	// (the track's next event is read right away, so the next time is always known)
+	m_event = m_tracks[m_track].event();
+	this->push(m_track);
+	return true;
+}
+
+// ------------------------------------------------------------------------------------------------
+bool MIDIFileMerger::play(MIDISink *out, quint32 until)
+{
+	while (!m_heap.isEmpty() && m_heap.first().time < until)
+	{
+		this->next();
+
+		const uint time = m_event.time - m_time;
+		m_time = m_event.time;
+
+		if (m_event.isChannelMessage())
+		{
+			out->streamSend(time, m_event.message());
+		}
+		else if (m_event.status == 0xF0)
+		{
+			// (the F0 isn't part of the event's data, so it has to be put back)
+			m_sysEx.resize(m_event.size + 1);
+			m_sysEx[0] = (char)0xF0;
+			memcpy(m_sysEx.data() + 1, m_event.data, m_event.size);
+			out->streamSend(time, m_sysEx);
+		}
+		else if (m_event.status == 0xF7)
+		{
+			out->streamSend(time, QByteArray::fromRawData((const char*)m_event.data, m_event.size));
+		}
+		else if (m_event.metaType == 0x51 && m_event.size == 3)
+		{
+			const quint32 tempo = (m_event.data[0] << 16) | (m_event.data[1] << 8) | m_event.data[2];
+			if (tempo)
+				out->streamSetTempo(time, 60000000.0 / tempo);
+			else
+				out->streamDelay(time);
+		}
+		else
+		{
+			out->streamDelay(time);
+		}
+	}
+
+	if (m_heap.isEmpty())
+		return false;
+
+	// (if the time went backwards, there's nothing to pad out)
+	if (until > m_time)
+	{
+		out->streamDelay(until - m_time);
+		m_time = until;
+	}
+	return true;
+}
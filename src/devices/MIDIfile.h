@@ -0,0 +1,247 @@
+/*
+ * Standard MIDI File support.
+ *
+ * MIDIFileWriter is a sink (see MIDIsink.h) which writes everything streamed to it straight to
+ * a type 0 or type 1 MIDI file, using the same relative timestamps as MIDIOutput's stream.
+ * Output is buffered in fixed-size blocks, and the length of each track (and the number of
+ * tracks) is filled in once it's known, so writing a file of any size uses the same amount of
+ * memory.
+ *
+ * MIDIFileReader maps a file into memory instead of reading it, and only finds where each track
+ * is when opening it. Events are read one at a time as each track is iterated through (see
+ * MIDIFileTrack), or from all tracks at once in time order (see MIDIFileMerger); either way,
+ * each event just points to its data in the mapped file, so nothing is copied or allocated.
+ * Events can be sent straight to a sink (e.g. a MIDIOutput stream) with MIDIFileMerger::play().
+ */
+
+#ifndef MIDIFILE_H
+#define MIDIFILE_H
+
+#include "MIDIsink.h"
+#include <QString>
+#include <QVector>
+
+class QFile;
+
+class MIDIFileWriter : public MIDISink
+{
+public:
+	/* \param ppq ticks per quarter note (every timestamp is in these)
+	 */
+	explicit MIDIFileWriter(uint ppq = 96);
+	~MIDIFileWriter();
+
+	/* Start writing a new file, closing the current one first.
+	 * \param format 0 to write everything in one track, or 1 to write several (see newTrack())
+	 * \returns whether or not the file was opened successfully
+	 */
+	bool open(const QString &fileName, uint format = 0);
+	/* Finish the current track and start writing the next one (type 1 files only).
+	 * Timestamps in the new track start over from the beginning of the file.
+	 * \returns whether or not everything was written successfully so far
+	 */
+	bool newTrack();
+	/* Finish the file. Anything still pending from streamDelay() becomes the length
+	 * of the last track.
+	 * \returns whether or not the whole file was written successfully
+	 */
+	bool close();
+
+	bool isOpen() const { return m_file; }
+	// the first error encountered while writing the current (or last) file
+	QString errorString() const { return m_error; }
+
+	MIDIChannelState& channels() { return m_channels; }
+
+	/* Short system messages (which can't be stored in a MIDI file) are skipped,
+	 * but their timestamps are kept.
+	 */
+	void streamSend(uint time, MIDIMessage message);
+	/* Long messages which don't start with F0 are written as escaped data (F7 events).
+	 */
+	void streamSend(uint time, const QByteArray &data);
+	void streamSetTempo(uint time, double bpm);
+	void streamDelay(uint time);
+
+private:
+	void beginTrack();
+	void endTrack();
+
+	void writeDelta(uint time);
+	void writeNumber(quint32 value);
+	void write(const char *data, uint size);
+	void write(quint8 byte)
+	{
+		write((const char*)&byte, 1);
+	}
+	void writeAt(qint64 pos, quint32 value, uint size);
+	bool flush();
+
+	QFile *m_file;
+	QString m_error;
+	MIDIChannelState m_channels;
+
+	QByteArray m_buffer;
+	uint m_ppq, m_format, m_tracks;
+
+	// position of the current track's header in the file, and the size of its contents so far
+	qint64 m_trackStart;
+	quint32 m_trackSize;
+
+	// time since the last event written
+	uint m_pending;
+	quint8 m_runningStatus;
+};
+
+/*
+ * A single event from a MIDI file. The data belongs to the file, and is only valid while the
+ * reader it came from is open.
+ */
+struct MIDIFileEvent
+{
+	// time in ticks from the start of the file
+	quint32 time;
+	// status of a channel message (with running status already taken care of),
+	// 0xF0 or 0xF7 for SysEx and escaped data, or 0xFF for meta events
+	quint8 status;
+	// meta event type
+	quint8 metaType;
+
+	// the data bytes of a channel message, or the contents of any other event
+	// (for SysEx events, this is everything after the initial F0)
+	const uchar *data;
+	quint32 size;
+
+	bool isChannelMessage() const { return status < 0xF0; }
+	bool isSysEx() const { return status == 0xF0 || status == 0xF7; }
+	bool isMeta() const { return status == 0xFF; }
+
+	MIDIMessage message() const
+	{
+		return MIDIMessage(status, size > 0 ? data[0] : 0, size > 1 ? data[1] : 0);
+	}
+};
+
+Q_DECLARE_TYPEINFO(MIDIFileEvent, Q_PRIMITIVE_TYPE);
+
+/*
+ * Reads the events of one track, one at a time:
+ *   MIDIFileTrack track = file.track(0);
+ *   while (track.next())
+ *       doSomethingWith(track.event());
+ */
+class MIDIFileTrack
+{
+public:
+	MIDIFileTrack(const uchar *data = nullptr, quint32 size = 0);
+
+	/* Read the next event.
+	 * \returns false at the end of the track (or where the rest of the track isn't valid)
+	 */
+	bool next();
+	const MIDIFileEvent& event() const { return m_event; }
+
+private:
+	bool readNumber(quint32 &value);
+
+	const uchar *m_pos, *m_end;
+	quint8 m_runningStatus;
+	MIDIFileEvent m_event;
+};
+
+Q_DECLARE_TYPEINFO(MIDIFileTrack, Q_PRIMITIVE_TYPE);
+
+class MIDIFileReader
+{
+public:
+	MIDIFileReader();
+	~MIDIFileReader();
+
+	/* Open and map a file, closing the current one first.
+	 * Files using SMPTE time (rather than ticks per quarter note) aren't supported.
+	 * \returns whether or not the file was opened successfully
+	 */
+	bool open(const QString &fileName);
+	void close();
+
+	bool isOpen() const { return m_file; }
+	QString errorString() const { return m_error; }
+
+	uint format() const { return m_format; }
+	// ticks per quarter note
+	uint ppq() const { return m_ppq; }
+
+	uint trackCount() const { return m_tracks.size(); }
+	MIDIFileTrack track(uint track) const;
+
+private:
+	QFile *m_file;
+	QString m_error;
+
+	const uchar *m_data;
+	qint64 m_size;
+
+	uint m_format, m_ppq;
+	// where the contents of each track are in the file
+	struct Chunk
+	{
+		quint32 start, size;
+	};
+	QVector<Chunk> m_tracks;
+};
+
+/*
+ * Reads the events of every track of a file at once, in time order.
+ * Events at the same time are read in track order.
+ */
+class MIDIFileMerger
+{
+public:
+	explicit MIDIFileMerger(const MIDIFileReader &file);
+
+	/* Read the next event.
+	 * \returns false once every track has ended
+	 */
+	bool next();
+	const MIDIFileEvent& event() const { return m_event; }
+	// the track the current event is from
+	uint track() const { return m_track; }
+
+	/* Send events to a sink as stream messages, up to a given time.
+	 * Tempo changes are sent with streamSetTempo(), and other meta events are skipped.
+	 * If any events are left, the stream is padded out to the given time with streamDelay(),
+	 * so calling this with a steadily increasing time (e.g. whenever a MIDIOutput stream asks
+	 * for more data) plays the file in even-sized chunks. A time earlier than the last one
+	 * doesn't send anything.
+	 * \param until the time (in ticks from the start of the file) to stop before
+	 * \returns whether or not there are events left
+	 */
+	bool play(MIDISink *out, quint32 until = 0xFFFFFFFF);
+
+private:
+	struct Head
+	{
+		quint32 time;
+		uint track;
+
+		// (reversed, so the heap has the earliest event on top)
+		bool operator<(const Head &other) const
+		{
+			return time != other.time ? time > other.time : track > other.track;
+		}
+	};
+
+	void push(uint track);
+
+	QVector<MIDIFileTrack> m_tracks;
+	QVector<Head> m_heap;
+
+	MIDIFileEvent m_event;
+	uint m_track;
+
+	// time of the last event sent by play(), and a buffer for SysEx messages
+	quint32 m_time;
+	QByteArray m_sysEx;
+};
+
+#endif // MIDIFILE_H
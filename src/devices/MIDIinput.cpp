@@ -0,0 +1,390 @@
+/*
+ * Non-platform specific MIDI input functions
+ */
+
+#include "MIDIinput.h"
+#include "MIDIoutput.h"
+#include "MIDIdefs.h"
+
+#include <QFile>
+#include <QMetaMethod>
+#include <QThread>
+#include <QVarLengthArray>
+
+// maximum number of events delivered by each midiEvents() signal
+#define EVENT_BATCH_SIZE 256
+
+// ------------------------------------------------------------------------------------------------
+// whether a message releases something (notes or pedals) which would get stuck if it were lost
+static bool isRelease(MIDIMessage message)
+{
+	switch (message.type())
+	{
+	case MIDIMessage::NoteOff:
+		return true;
+
+	case MIDIMessage::NoteOn:
+		return !message.data2();
+
+	case MIDIMessage::Control:
+		switch (message.data1())
+		{
+		case CC_HOLD_PEDAL:
+		case CC_SOSTENUTO_PEDAL:
+			return message.data2() < 64;
+
+		case CC_ALL_SOUND_OFF:
+		case CC_ALL_CONTROLLERS_OFF:
+		case CC_ALL_NOTES_OFF:
+			return true;
+		}
+		break;
+	}
+
+	return false;
+}
+
+// ------------------------------------------------------------------------------------------------
+static void sendThru(MIDIOutput *output, const MIDIThru &thru, MIDIMessage message)
+{
+	if (!message.isChannelMessage())
+	{
+		output->send(message);
+		return;
+	}
+
+	if (thru.channel >= 0)
+		message = message.rerouted(thru.channel);
+
+	switch (message.type())
+	{
+	case MIDIMessage::NoteOff:
+		if (thru.velocity >= 0)
+			message = MIDIMessage::noteOff(message.channel(), message.data1(), thru.velocity);
+		break;
+
+	case MIDIMessage::NoteOn:
+		// leave note-ons with zero velocity alone, since they're really note-offs
+		if (thru.velocity >= 0 && message.data2())
+			message = MIDIMessage::noteOn(message.channel(), message.data1(), thru.velocity);
+		break;
+
+	case MIDIMessage::Pitch:
+		if (thru.pitchOffset)
+		{
+			int value = message.word() + thru.pitchOffset;
+			message = MIDIMessage::pitch(message.channel(), qBound(0, value, 0x3FFF));
+		}
+		break;
+	}
+
+	output->send(message);
+}
+
+// ------------------------------------------------------------------------------------------------
+bool MIDIInput::setThru(MIDIOutput *output, const MIDIThru &thru)
+{
+	if (!output) return false;
+
+	this->removeThru(output);
+
+	ThruRoute route;
+	route.output = output;
+	route.thru = thru;
+	// let the system handle routing if we don't need to change anything
+	route.direct = thru.isDirect() && this->connectThru(output);
+
+	QMutexLocker lock(&m_thruLock);
+	m_thru.append(route);
+
+	return true;
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIInput::removeThru(MIDIOutput *output)
+{
+	QMutexLocker lock(&m_thruLock);
+
+	for (int i = 0; i < m_thru.size(); i++)
+	{
+		if (m_thru[i].output == output)
+		{
+			if (m_thru[i].direct)
+				this->disconnectThru(output);
+
+			m_thru.removeAt(i);
+			return;
+		}
+	}
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIInput::clearThru()
+{
+	QMutexLocker lock(&m_thruLock);
+
+	for (const ThruRoute &route : m_thru)
+	{
+		if (route.direct)
+			this->disconnectThru(route.output);
+	}
+
+	m_thru.clear();
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIInput::queueEvent(MIDIMessage message, quint64 time)
+{
+	// pass the event through before doing anything else with it
+	// (the routes are copied first, so that nothing is locked while the outputs are used)
+	QVarLengthArray<ThruRoute, 8> routes;
+	{
+		QMutexLocker lock(&m_thruLock);
+
+		for (const ThruRoute &route : m_thru)
+		{
+			if (!route.direct)
+				routes.append(route);
+		}
+	}
+
+	for (const ThruRoute &route : routes)
+		sendThru(route.output, route.thru, message);
+
+	MIDIInputEvent ev;
+	ev.message = message;
+	ev.time    = time;
+
+	// if events aren't being handled fast enough to keep up, drop the new ones
+	// (except for releases, which can still use the last part of the queue)
+	if (!m_events.push(ev, isRelease(message) ? 0 : EVENT_IN_RESERVE))
+	{
+		m_eventsDropped.fetchAndAddOrdered(1);
+		return;
+	}
+
+	this->scheduleEvents();
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIInput::scheduleEvents()
+{
+	// only wake up the device's thread if it isn't about to handle new events already
+	if (m_eventsPending.testAndSetOrdered(0, 1))
+		QMetaObject::invokeMethod(this, "processEvents", Qt::QueuedConnection);
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIInput::processEvents()
+{
+	// any events queued from here on will cause this to be called again
+	m_eventsPending.storeRelease(0);
+
+	// (anything dropped from here on is reported next time)
+	int dropped = m_eventsDropped.fetchAndStoreOrdered(0);
+	if (dropped)
+		emit this->error(tr("%1 incoming events were dropped because the queue was full").arg(dropped));
+
+	static const QMetaMethod midiEventSignal = QMetaMethod::fromSignal(&MIDIInput::midiEvent);
+	bool singleEvents = this->isSignalConnected(midiEventSignal);
+
+	MIDIInputEvent events[EVENT_BATCH_SIZE];
+	uint count;
+
+	while ((count = m_events.pop(events, EVENT_BATCH_SIZE)) > 0)
+	{
+		emit this->midiEvents(events, count);
+
+		if (!singleEvents) continue;
+
+		for (uint i = 0; i < count; i++)
+		{
+			const MIDIInputEvent &ev = events[i];
+			emit this->midiEvent(ev.message, ev.time);
+		}
+	}
+
+	if (m_sysExFile)
+		this->saveSysEx();
+}
+
+// ------------------------------------------------------------------------------------------------
+bool MIDIInput::startSysEx(const QString &fileName)
+{
+	// finish saving the last message first, if it's still being saved
+	if (m_sysExFile)
+		this->saveSysEx();
+
+	QMutexLocker lock(&m_sysExLock);
+
+	if (m_sysExRecording) return true;
+
+	m_sysExToFile = !fileName.isEmpty();
+	if (m_sysExToFile)
+	{
+		auto file = new QFile(fileName);
+		if (!file->open(QIODevice::WriteOnly))
+		{
+			emit this->error(file->errorString());
+			delete file;
+			m_sysExToFile = false;
+			return false;
+		}
+
+		m_sysExFile = file;
+		m_sysExResult.storeRelease(SysExPending);
+	}
+	else
+	{
+		m_buffer.clear();
+		m_buffer.reserve(SYSEX_RECORD_SIZE);
+	}
+
+	m_sysExStarted = false;
+	m_sysExRecording = true;
+	return true;
+}
+
+// ------------------------------------------------------------------------------------------------
+bool MIDIInput::appendSysEx(const char *data, uint size)
+{
+	if (m_sysExToFile)
+	{
+		// (this never blocks, so a slow disk can't hold up input for every device)
+		if (!m_sysExQueue.push(data, size))
+			return false;
+
+		this->scheduleEvents();
+	}
+	else
+	{
+		// grow the buffer geometrically, so large dumps don't reallocate for every piece
+		int needed = m_buffer.size() + (int)size;
+		if (needed > m_buffer.capacity())
+			m_buffer.reserve(qMax(needed, 2 * m_buffer.capacity()));
+
+		m_buffer.append(data, size);
+	}
+
+	return true;
+}
+
+// ------------------------------------------------------------------------------------------------
+bool MIDIInput::receiveSysEx(const char *data, uint size, quint64 time)
+{
+	QMutexLocker lock(&m_sysExLock);
+
+	if (!m_sysExRecording) return false;
+
+	bool complete = false;
+
+	if (size)
+	{
+		// ignore anything before the start of a message
+		if (!m_sysExStarted)
+		{
+			if ((quint8)data[0] != EVENT_SYSEX_START)
+				return true;
+
+			m_sysExStarted = true;
+		}
+
+		if (this->appendSysEx(data, size))
+		{
+			// keep going until the end of the message
+			if ((quint8)data[size - 1] != EVENT_SYSEX_END)
+				return true;
+
+			complete = true;
+		}
+	}
+
+	// recording is finished (or was interrupted)
+	m_sysExRecording = false;
+
+	if (m_sysExToFile)
+	{
+		// let the device's thread finish the file once it has written everything before this
+		m_sysExToFile = false;
+		m_sysExTime = time;
+		m_sysExResult.storeRelease(complete ? SysExComplete : size ? SysExOverflow : SysExFailed);
+
+		lock.unlock();
+
+		// (when cancelled from the device's own thread, e.g. while closing, finish right away)
+		if (QThread::currentThread() == this->thread())
+			this->saveSysEx();
+		else
+			this->scheduleEvents();
+		return false;
+	}
+
+	QByteArray buffer = complete ? m_buffer : QByteArray();
+	m_buffer.clear();
+
+	lock.unlock();
+
+	emit this->sysExRecorded(buffer, time);
+	return false;
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIInput::saveSysEx()
+{
+	// (check the result first, so everything queued before it was set gets written below)
+	int result = m_sysExResult.loadAcquire();
+
+	char data[4096];
+	uint size;
+
+	while ((size = m_sysExQueue.pop(data, sizeof(data))) > 0)
+	{
+		if (!m_sysExWriteFailed && m_sysExFile->write(data, size) != (qint64)size)
+		{
+			emit this->error(m_sysExFile->errorString());
+			m_sysExWriteFailed = true;
+		}
+	}
+
+	if (m_sysExWriteFailed && result == SysExPending)
+	{
+		// stop recording the rest of the message
+		QMutexLocker lock(&m_sysExLock);
+
+		if (m_sysExRecording)
+		{
+			m_sysExRecording = false;
+			m_sysExToFile = false;
+			m_sysExResult.storeRelease(SysExFailed);
+		}
+		result = m_sysExResult.loadAcquire();
+
+		lock.unlock();
+
+		// throw away anything which was queued in the meantime
+		while (m_sysExQueue.pop(data, sizeof(data)) > 0) {}
+	}
+
+	if (result == SysExPending) return;
+
+	// the message is done
+	QFile *file = m_sysExFile;
+	m_sysExFile = nullptr;
+
+	if (result == SysExOverflow)
+		emit this->error(tr("SysEx data arrived faster than it could be saved"));
+
+	const bool complete = result == SysExComplete && !m_sysExWriteFailed;
+	m_sysExWriteFailed = false;
+
+	QString fileName = file->fileName();
+	qint64 fileSize = complete ? file->size() : 0;
+
+	if (complete)
+		file->close();
+	else
+		file->remove();
+	delete file;
+
+	emit this->sysExSaved(fileName, fileSize, m_sysExTime);
+}
@@ -14,9 +14,55 @@
 #define MIDIINPUT_H
 
 #include "MIDIdevice.h"
+#include "MIDImessage.h"
+#include "RingBuffer.h"
+#include <QAtomicInt>
 #include <QList>
+#include <QMutex>
 
 #define SYSEX_IN_BUF_SIZE 1024
+// initial size of the buffer for SysEx messages recorded to memory (grows as needed)
+#define SYSEX_RECORD_SIZE (64 * 1024)
+// how much of a SysEx message being recorded to a file can be waiting to be written
+// (must be a power of two)
+#define SYSEX_FILE_QUEUE_SIZE (256 * 1024)
+// number of incoming events which can be waiting to be delivered (must be a power of two)
+#define EVENT_IN_BUF_SIZE 4096
+// how much of the event queue is kept for note offs and pedal releases only, so a flood of
+// other events can't leave notes stuck
+#define EVENT_IN_RESERVE 256
+
+/*
+ * A single incoming MIDI event.
+ */
+struct MIDIInputEvent
+{
+	MIDIMessage message;
+	// time (in microseconds) when the event occurred after opening the device
+	quint64 time;
+};
+
+/*
+ * Options for passing incoming events through to an output device.
+ * The default options pass events through unchanged.
+ */
+struct MIDIThru
+{
+	// channel to send channel messages on, or -1 to keep the original channel
+	qint8 channel = -1;
+	// velocity to use for note on/off messages, or -1 to keep the original velocity
+	qint8 velocity = -1;
+	// amount to add to pitch bend values
+	qint16 pitchOffset = 0;
+
+	bool isDirect() const
+	{
+		return channel < 0 && velocity < 0 && pitchOffset == 0;
+	}
+};
+
+class MIDIOutput;
+class QFile;
 
 class MIDIInput : public MIDIDevice
 {
@@ -34,6 +80,37 @@ public:
 
 	QString name() const;
 
+	/* Pass an incoming event from the platform's input thread or callback to the device.
+	 * Events are queued without locking or allocating, and delivered in batches by the
+	 * midiEvents() signal in the device's own thread.
+	 * This should only be called by the platform-specific implementation.
+	 */
+	void queueEvent(MIDIMessage message, quint64 time);
+
+	/* Pass part of an incoming SysEx message from the platform's input thread or callback
+	 * to the device. The message is recorded if recordSysEx() was called first.
+	 * A size of zero means the message was interrupted.
+	 * This should only be called by the platform-specific implementation.
+	 * \returns true if recording is still waiting for the rest of a message, false otherwise
+	 */
+	bool receiveSysEx(const char *data, uint size, quint64 time);
+
+	/* Pass incoming short messages through to an output device. This happens in the platform's
+	 * input thread or callback (or in the system itself, if possible), so thru messages are not
+	 * delayed by anything happening in the device's own thread.
+	 * Setting a thru route to an output replaces any existing thru route to the same output.
+	 * \param output The output device, which must be open.
+	 * \param thru Options for changing events on their way through.
+	 * \returns whether or not the thru route was set successfully
+	 */
+	bool setThru(MIDIOutput *output, const MIDIThru &thru = MIDIThru());
+	/* Stop passing incoming messages through to an output device.
+	 */
+	void removeThru(MIDIOutput *output);
+	/* Stop passing incoming messages through to any output device.
+	 */
+	void clearThru();
+
 public slots:
 	bool open();
 	bool close();
@@ -45,25 +122,105 @@ public slots:
 	 * \returns true if recording started successfully (or was started already), false otherwise
 	 */
 	bool recordSysEx();
+	/* Begin listening for a single SysEx message from the input device, and write it directly
+	 * to a file as it is received, so even very large messages are never kept in memory.
+	 * After the message is received, sysExSaved() is emitted and recording stops.
+	 * Calling this while recording is already enabled does nothing.
+	 * \returns true if recording started successfully (or was started already), false otherwise
+	 */
+	bool recordSysEx(const QString &fileName);
 
 signals:
-	/* Emitted when any MIDI event occurs.
-	 * \param time The time (in ms) when the event occurred after opening the device.
+	/* Emitted when one or more MIDI events have occurred since the last time this was emitted.
+	 * The events are only valid until the connected slot returns, so this should only be
+	 * connected to objects in the same thread as the device.
+	 * \param events The received events, in the order they were received.
+	 * \param count The number of events.
+	 */
+	void midiEvents(const MIDIInputEvent *events, uint count);
+
+	/* Emitted for each event after midiEvents() has been emitted, if anything is connected to it.
+	 * \param time The time (in microseconds) when the event occurred after opening the device.
 	 * TODO: additional signals for specific common events (maybe)
 	 */
-	void midiEvent(quint8 event, quint8 data1, quint8 data2, uint time);
+	void midiEvent(MIDIMessage message, quint64 time);
 
 	/* Emitted when a SysEx message is recorded.
 	 * Call recordSysEx() first to enable SysEx recording. Only one message is recorded per call.
 	 * \param data The complete SysEx message. May be empty if recording was cancelled or interrupted.
-	 * \param time The time (in ms) when the message was received after opening the device.
+	 * \param time The time (in microseconds) when the message was received after opening the device.
 	 */
-	void sysExRecorded(QByteArray data, uint time);
+	void sysExRecorded(QByteArray data, quint64 time);
+
+	/* Emitted when a SysEx message is recorded to a file.
+	 * Call recordSysEx(fileName) first to enable SysEx recording.
+	 * \param fileName The file the message was written to.
+	 * \param size The size of the message. If recording was cancelled or interrupted,
+	 *             this is zero and the file is removed.
+	 * \param time The time (in microseconds) when the message was received after opening the device.
+	 */
+	void sysExSaved(QString fileName, qint64 size, quint64 time);
+
+private slots:
+	void processEvents();
 
 private:
 	struct InputInfo *m_info;
 	QByteArray m_buffer;
 
+	// SysEx recording state (shared with the platform's input thread or callback)
+	QMutex m_sysExLock;
+	bool m_sysExRecording = false;
+	bool m_sysExStarted = false;
+	bool m_sysExToFile = false;
+	quint64 m_sysExTime = 0;
+
+	// when recording to a file, the input thread only queues the data, and the file itself
+	// is only used by the device's own thread (see saveSysEx())
+	enum { SysExPending, SysExComplete, SysExFailed, SysExOverflow };
+	RingBuffer<char, SYSEX_FILE_QUEUE_SIZE> m_sysExQueue;
+	QAtomicInt m_sysExResult;
+	QFile *m_sysExFile = nullptr;
+	bool m_sysExWriteFailed = false;
+
+	/* Set up recording of a SysEx message. If fileName is empty, the message is recorded to memory.
+	 * \returns true if recording started successfully (or was started already), false otherwise
+	 */
+	bool startSysEx(const QString &fileName);
+	/* Add part of a SysEx message to the file queue or buffer being recorded to.
+	 * \returns false if the data couldn't be added
+	 */
+	bool appendSysEx(const char *data, uint size);
+	/* Write whatever has been queued for the file being recorded to, and finish the file
+	 * if the whole message has been received.
+	 */
+	void saveSysEx();
+
+	// make sure processEvents() is called soon (from any thread)
+	void scheduleEvents();
+
+	struct ThruRoute
+	{
+		MIDIOutput *output;
+		MIDIThru thru;
+		// whether events are routed by the system instead of by us
+		bool direct;
+	};
+	QList<ThruRoute> m_thru;
+	QMutex m_thruLock;
+
+	/* Platform-specific setup for passing messages straight to an output device.
+	 * \returns false if this isn't supported (events will be passed through by queueEvent()).
+	 */
+	bool connectThru(MIDIOutput *output);
+	void disconnectThru(MIDIOutput *output);
+
+	RingBuffer<MIDIInputEvent, EVENT_IN_BUF_SIZE> m_events;
+	// set while a call to processEvents() is pending
+	QAtomicInt m_eventsPending;
+	// number of events dropped because the queue was full, since processEvents() last checked
+	QAtomicInt m_eventsDropped;
+
 	static QList<MIDIInput*> devices;
 };
 
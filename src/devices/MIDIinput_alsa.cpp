@@ -3,6 +3,7 @@
  */
 
 #include "MIDIinput.h"
+#include "MIDIoutput.h"
 #include "alsa.h"
 
 #define TEST(rc, ...) \
@@ -21,7 +22,7 @@ struct InputInfo
 	snd_seq_port_info_t *portInfo = nullptr;
 	snd_seq_port_subscribe_t *subsInfo = nullptr;
 
-	InputThread *thread = nullptr;
+	bool opened = false;
 };
 
 // ------------------------------------------------------------------------------------------------
@@ -77,9 +78,10 @@ MIDIInput::MIDIInput(uint id)
 	snd_seq_port_subscribe_set_sender(m_info->subsInfo, &src);
 	snd_seq_port_subscribe_set_dest(m_info->subsInfo, &dest);
 
-	m_info->thread = new InputThread(this);
-	connect(m_info->thread, SIGNAL(midiEvent(quint8,quint8,quint8,uint)),
-			this, SIGNAL(midiEvent(quint8,quint8,quint8,uint)));
+	// have the sequencer timestamp incoming events as soon as they arrive
+	snd_seq_port_subscribe_set_queue(m_info->subsInfo, ALSA::seq_inqueue);
+	snd_seq_port_subscribe_set_time_update(m_info->subsInfo, 1);
+	snd_seq_port_subscribe_set_time_real(m_info->subsInfo, 1);
 
 	m_valid = true;
 }
@@ -87,6 +89,7 @@ MIDIInput::MIDIInput(uint id)
 // ------------------------------------------------------------------------------------------------
 MIDIInput::~MIDIInput()
 {
+	this->clearThru();
 	this->close();
 
 	if (m_info->portInfo)
@@ -118,15 +121,24 @@ bool MIDIInput::open()
 		return false;
 	}
 
+	// do nothing if device was opened already
+	if (m_info->opened) return true;
+
 	int rc;
 
+	ALSA::addInput(m_deviceID, this);
+
 	rc = snd_seq_subscribe_port(ALSA::seq_handle, m_info->subsInfo);
-	TEST(rc, false);
+	if (rc < 0)
+	{
+		ALSA::removeInput(m_deviceID);
+		emit this->error(snd_strerror(rc));
+		return false;
+	}
 
+	m_info->opened = true;
 	emit this->opened();
 
-	m_info->thread->start();
-
 	return true;
 }
 
@@ -138,19 +150,18 @@ bool MIDIInput::close()
 	int rc;
 
 	// do nothing if device was closed already
-	// TODO
-
-	this->reset();
+	if (!m_info->opened) return true;
 
 	rc = snd_seq_unsubscribe_port(ALSA::seq_handle, m_info->subsInfo);
 	TEST(rc, false);
 
-	if (m_info->thread->isRunning())
-	{
-		m_info->thread->requestInterruption();
-		m_info->thread->wait();
-		emit this->closed();
-	}
+	ALSA::removeInput(m_deviceID);
+
+	// cancel SysEx recording
+	this->receiveSysEx(nullptr, 0, 0);
+
+	m_info->opened = false;
+	emit this->closed();
 
 	// device was closed successfully
 	return true;
@@ -159,19 +170,66 @@ bool MIDIInput::close()
 // ------------------------------------------------------------------------------------------------
 bool MIDIInput::reset()
 {
-	int rc = snd_seq_drop_input(ALSA::seq_handle);
-	TEST(rc, false);
+	// cancel SysEx recording
+	this->receiveSysEx(nullptr, 0, 0);
+
+	// throw away events which haven't been delivered yet
+	// (the sequencer's own input buffer is shared by every device, so leave that alone)
+	MIDIInputEvent events[64];
+	while (m_events.pop(events, 64) > 0) {}
 
 	return true;
 }
 
 // ------------------------------------------------------------------------------------------------
 bool MIDIInput::recordSysEx()
+{
+	return this->recordSysEx(QString());
+}
+
+// ------------------------------------------------------------------------------------------------
+bool MIDIInput::recordSysEx(const QString &fileName)
+{
+	if (!m_valid || !m_info->opened) return false;
+
+	// the input thread passes along SysEx data as soon as it arrives
+	return this->startSysEx(fileName);
+}
+
+// ------------------------------------------------------------------------------------------------
+static void initThru(snd_seq_port_subscribe_t *subs, const InputInfo *info, MIDIOutput *output)
+{
+	snd_seq_addr_t src, dest;
+	src.client  = info->client;
+	src.port    = info->port;
+	dest.client = output->id() >> 8;
+	dest.port   = output->id() & 0xFF;
+
+	snd_seq_port_subscribe_set_sender(subs, &src);
+	snd_seq_port_subscribe_set_dest(subs, &dest);
+}
+
+// ------------------------------------------------------------------------------------------------
+bool MIDIInput::connectThru(MIDIOutput *output)
 {
 	if (!m_valid) return false;
 
-	emit this->error("not implemented yet");
-	// TODO
+	// connect the input device straight to the output device
+	snd_seq_port_subscribe_t *subs;
+	snd_seq_port_subscribe_alloca(&subs);
+	initThru(subs, m_info, output);
+
+	return 0 <= snd_seq_subscribe_port(ALSA::seq_handle, subs);
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIInput::disconnectThru(MIDIOutput *output)
+{
+	if (!m_valid) return;
+
+	snd_seq_port_subscribe_t *subs;
+	snd_seq_port_subscribe_alloca(&subs);
+	initThru(subs, m_info, output);
 
-	return false;
+	snd_seq_unsubscribe_port(ALSA::seq_handle, subs);
 }
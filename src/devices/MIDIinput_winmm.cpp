@@ -42,8 +42,6 @@ static void emitError(MIDIInput *self, MMRESULT error)
 static void CALLBACK midiCallback(HMIDIIN handle, UINT msg, DWORD_PTR instance,
 						   DWORD_PTR dw1, DWORD_PTR dw2)
 {
-	Q_UNUSED(handle);
-
 	if (!instance)
 	{
 		Q_ASSERT(!"MIDI input callback called with null instance");
@@ -55,24 +53,19 @@ static void CALLBACK midiCallback(HMIDIIN handle, UINT msg, DWORD_PTR instance,
 
 	if (msg == MIM_DATA)
 	{
-		quint8 event = dw1 >> 0;
-		quint8 data1 = (dw1 >> 8)  & 0x7F;
-		quint8 data2 = (dw1 >> 16) & 0x7F;
-
-		emit self->midiEvent(event, data1, data2, dw2);
+		// (short messages arrive packed the same way as MIDIMessage)
+		self->queueEvent(MIDIMessage::fromPacked(dw1 & 0x7F7FFF), (quint64)dw2 * 1000);
 	}
 	else if (msg == MIM_LONGDATA)
 	{
-		// handle sysex
+		// handle sysex (an empty buffer means recording was interrupted)
 		auto header = reinterpret_cast<MIDIHDR*>(dw1);
-		auto buffer = reinterpret_cast<QByteArray*>(header->dwUser);
-
-		buffer->append(header->lpData, header->dwBytesRecorded);
 
-		if (header->dwFlags & MHDR_DONE)
+		if (self->receiveSysEx(header->lpData, header->dwBytesRecorded, (quint64)dw2 * 1000))
 		{
-			emit self->sysExRecorded(*buffer, dw2);
-			buffer->clear();
+			// the message didn't fit in the buffer, so reuse it for the rest
+			// TODO: is this call safe here?
+			midiInAddBuffer(handle, header, sizeof(MIDIHDR));
 		}
 	}
 	else if (msg == MIM_OPEN)
@@ -124,6 +117,7 @@ MIDIInput::MIDIInput(uint id)
 // ------------------------------------------------------------------------------------------------
 MIDIInput::~MIDIInput()
 {
+	this->clearThru();
 	this->close();
 	delete m_info;
 }
@@ -157,7 +151,7 @@ bool MIDIInput::open()
 	m_info->header.lpData = new CHAR[SYSEX_IN_BUF_SIZE];
 	m_info->header.dwBufferLength = SYSEX_IN_BUF_SIZE;
 	m_info->header.dwFlags = 0;
-	m_info->header.dwUser = (DWORD_PTR)&m_buffer;
+	m_info->header.dwUser = 0;
 	result = midiInPrepareHeader(m_info->handle, &m_info->header, sizeof(MIDIHDR));
 	if (MMSYSERR_NOERROR != result)
 	{
@@ -212,9 +206,18 @@ bool MIDIInput::reset()
 
 // ------------------------------------------------------------------------------------------------
 bool MIDIInput::recordSysEx()
+{
+	return this->recordSysEx(QString());
+}
+
+// ------------------------------------------------------------------------------------------------
+bool MIDIInput::recordSysEx(const QString &fileName)
 {
 	if (!m_valid || !m_info->handle) return false;
 
+	if (!this->startSysEx(fileName))
+		return false;
+
 	// use sysex buffer
 	MMRESULT result = midiInAddBuffer(m_info->handle, &m_info->header, sizeof(MIDIHDR));
 	if (MMSYSERR_NOERROR != result &&
@@ -226,3 +229,18 @@ bool MIDIInput::recordSysEx()
 
 	return true;
 }
+
+// ------------------------------------------------------------------------------------------------
+bool MIDIInput::connectThru(MIDIOutput *output)
+{
+	Q_UNUSED(output);
+
+	// events are always passed through by the callback
+	return false;
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIInput::disconnectThru(MIDIOutput *output)
+{
+	Q_UNUSED(output);
+}
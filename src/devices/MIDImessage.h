@@ -0,0 +1,136 @@
+/*
+ * A short (up to three byte) MIDI message, packed into a single 32-bit value.
+ *
+ * The status byte is in the low byte, followed by the two data bytes, which is the same layout
+ * WinMM uses for short messages. Messages are trivially copyable and can be built at compile
+ * time, e.g. MIDIMessage::noteOn(9, 36, 127) or MIDIMessage::control(0, CC_VOLUME_MSB, 100).
+ * Channel numbers are 0-15, and data bytes are masked to 7 bits by the typed builders.
+ */
+
+#ifndef MIDIMESSAGE_H
+#define MIDIMESSAGE_H
+
+#include "MIDIdefs.h"
+#include <QMetaType>
+#include <QtGlobal>
+
+struct MIDIMessage
+{
+	// message types, as returned by type()
+	enum Type : quint8
+	{
+		NoteOff         = EVENT_NOTEOFF(0),
+		NoteOn          = EVENT_NOTEON(0),
+		Aftertouch      = EVENT_AFTERTOUCH(0),
+		Control         = EVENT_CONTROL(0),
+		Program         = EVENT_PROGRAM(0),
+		Pressure        = EVENT_PRESSURE(0),
+		Pitch           = EVENT_PITCH(0),
+
+		MTCQuarterFrame = EVENT_MTC_QTRFRAME,
+		SongPosition    = EVENT_SONG_POSITION,
+		SongSelect      = EVENT_SONG_SELECT,
+		TuneRequest     = EVENT_TUNE_REQUEST,
+
+		Clock           = EVENT_MIDI_CLOCK,
+		Tick            = EVENT_MIDI_TICK,
+		Start           = EVENT_MIDI_START,
+		Continue        = EVENT_MIDI_CONTINUE,
+		Stop            = EVENT_MIDI_STOP,
+		ActiveSense     = EVENT_ACTIVE_SENSE,
+		Reset           = EVENT_RESET
+	};
+
+	quint32 packed;
+
+	constexpr MIDIMessage()
+		: packed(0)
+	{
+	}
+	constexpr explicit MIDIMessage(quint8 data0, quint8 data1 = 0, quint8 data2 = 0)
+		: packed(data0 | (data1 << 8) | (data2 << 16))
+	{
+	}
+
+	static constexpr MIDIMessage fromPacked(quint32 packed)
+	{
+		return MIDIMessage(packed & 0xFF, (packed >> 8) & 0xFF, (packed >> 16) & 0xFF);
+	}
+
+	// builders for channel messages
+	static constexpr MIDIMessage noteOff(quint8 channel, quint8 note, quint8 velocity = 0)
+	{
+		return MIDIMessage(EVENT_NOTEOFF(channel & 0xF), note & 0x7F, velocity & 0x7F);
+	}
+	static constexpr MIDIMessage noteOn(quint8 channel, quint8 note, quint8 velocity)
+	{
+		return MIDIMessage(EVENT_NOTEON(channel & 0xF), note & 0x7F, velocity & 0x7F);
+	}
+	static constexpr MIDIMessage aftertouch(quint8 channel, quint8 note, quint8 pressure)
+	{
+		return MIDIMessage(EVENT_AFTERTOUCH(channel & 0xF), note & 0x7F, pressure & 0x7F);
+	}
+	static constexpr MIDIMessage control(quint8 channel, quint8 control, quint8 value = 0)
+	{
+		return MIDIMessage(EVENT_CONTROL(channel & 0xF), control & 0x7F, value & 0x7F);
+	}
+	static constexpr MIDIMessage program(quint8 channel, quint8 program)
+	{
+		return MIDIMessage(EVENT_PROGRAM(channel & 0xF), program & 0x7F);
+	}
+	static constexpr MIDIMessage pressure(quint8 channel, quint8 pressure)
+	{
+		return MIDIMessage(EVENT_PRESSURE(channel & 0xF), pressure & 0x7F);
+	}
+	// (the pitch bend value is 14 bits, centered at 0x2000)
+	static constexpr MIDIMessage pitch(quint8 channel, quint16 value)
+	{
+		return MIDIMessage(EVENT_PITCH(channel & 0xF), MIDI_LSB(value), MIDI_MSB(value));
+	}
+
+	// accessors
+	constexpr quint8 status() const { return packed & 0xFF; }
+	constexpr quint8 data1() const  { return (packed >> 8) & 0xFF; }
+	constexpr quint8 data2() const  { return (packed >> 16) & 0xFF; }
+
+	// the status without the channel (e.g. NoteOn), or the whole status for system messages
+	constexpr quint8 type() const
+	{
+		return status() < 0xF0 ? status() & 0xF0 : status();
+	}
+	constexpr quint8 channel() const { return status() & 0xF; }
+	constexpr bool isChannelMessage() const
+	{
+		return status() >= 0x80 && status() < 0xF0;
+	}
+	// the 14-bit value of a pitch bend or song position message
+	constexpr quint16 word() const { return MIDI_WORD(data2(), data1()); }
+
+	// the same message on a different channel (system messages are left alone)
+	constexpr MIDIMessage rerouted(quint8 channel) const
+	{
+		return isChannelMessage()
+				? fromPacked((packed & ~0xFu) | (channel & 0xF))
+				: *this;
+	}
+
+	constexpr bool operator==(MIDIMessage other) const { return packed == other.packed; }
+	constexpr bool operator!=(MIDIMessage other) const { return packed != other.packed; }
+};
+
+Q_DECLARE_TYPEINFO(MIDIMessage, Q_PRIMITIVE_TYPE);
+Q_DECLARE_METATYPE(MIDIMessage)
+
+/*
+ * A short MIDI message with a timestamp (in ticks) relative to the previous one,
+ * as passed to MIDISink::streamSend().
+ */
+struct MIDITimedMessage
+{
+	uint time;
+	MIDIMessage message;
+};
+
+Q_DECLARE_TYPEINFO(MIDITimedMessage, Q_PRIMITIVE_TYPE);
+
+#endif // MIDIMESSAGE_H
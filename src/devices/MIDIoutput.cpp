@@ -5,54 +5,907 @@
 #include "MIDIoutput.h"
 #include "MIDIdefs.h"
 
+#include <QMetaMethod>
+#include <cstring>
+
 // ------------------------------------------------------------------------------------------------
-void MIDIOutput::sendRPN(quint8 channel, quint16 param, quint16 value)
+void MIDIOutput::send(MIDIMessage message)
+{
+	QMutexLocker lock(m_channelState.lock());
+
+	if (!this->filterShort(false, message))
+		return;
+
+	this->trackParam(message);
+	this->trackNote(false, message);
+	this->sendShort(message);
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIOutput::send(const MIDIMessage *messages, uint count)
+{
+	QMutexLocker lock(m_channelState.lock());
+
+	this->beginBatch();
+
+	for (uint i = 0; i < count; i++)
+	{
+		const MIDIMessage &message = messages[i];
+
+		if (!this->filterShort(false, message))
+			continue;
+
+		this->trackParam(message);
+		this->trackNote(false, message);
+		this->sendShort(message);
+	}
+
+	this->commitBatch();
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIOutput::send(const QByteArray &data)
 {
-	this->send(EVENT_CONTROL(channel), CC_RPN_MSB,        MIDI_MSB(param));
-	this->send(EVENT_CONTROL(channel), CC_RPN_LSB,        MIDI_LSB(param));
+	// SysEx messages can reset just about anything on the receiving end
+	this->clearChannelState();
+	this->sendLong(data);
+}
 
-	this->send(EVENT_CONTROL(channel), CC_DATA_ENTRY_MSB, MIDI_MSB(value));
-	this->send(EVENT_CONTROL(channel), CC_DATA_ENTRY_LSB, MIDI_LSB(value));
+// ------------------------------------------------------------------------------------------------
+void MIDIOutput::sendRPN(quint8 channel, quint16 param, quint16 value)
+{
+	QMutexLocker lock(m_channelState.lock());
 
-	this->send(EVENT_CONTROL(channel), CC_RPN_MSB,        MIDI_MSB(RPN_RESET));
-//	this->send(EVENT_CONTROL(channel), CC_RPN_LSB,        MIDI_LSB(RPN_RESET));
+	this->beginBatch();
+	this->sendParam(-1, channel, CC_RPN_MSB, param, value);
+	this->commitBatch();
 }
 
 // ------------------------------------------------------------------------------------------------
 void MIDIOutput::sendNRPN(quint8 channel, quint16 param, quint16 value)
 {
-	this->send(EVENT_CONTROL(channel), CC_NRPN_MSB,       MIDI_MSB(param));
-	this->send(EVENT_CONTROL(channel), CC_NRPN_LSB,       MIDI_LSB(param));
+	QMutexLocker lock(m_channelState.lock());
+
+	this->beginBatch();
+	this->sendParam(-1, channel, CC_NRPN_MSB, param, value);
+	this->commitBatch();
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIOutput::setParamCaching(bool enable)
+{
+	QMutexLocker lock(m_channelState.lock());
+
+	m_paramCaching = enable;
+	this->clearChannelState();
+}
 
-	this->send(EVENT_CONTROL(channel), CC_DATA_ENTRY_MSB, MIDI_MSB(value));
-	this->send(EVENT_CONTROL(channel), CC_DATA_ENTRY_LSB, MIDI_LSB(value));
+// ------------------------------------------------------------------------------------------------
+void MIDIOutput::setFiltering(bool enable)
+{
+	QMutexLocker lock(m_channelState.lock());
 
-	this->send(EVENT_CONTROL(channel), CC_NRPN_MSB,       MIDI_MSB(RPN_RESET));
-//	this->send(EVENT_CONTROL(channel), CC_NRPN_LSB,       MIDI_LSB(RPN_RESET));
+	m_filtering = enable;
+	this->clearChannelState();
 }
 
 // ------------------------------------------------------------------------------------------------
-void MIDIOutput::streamSendRPN(uint time, quint8 channel, quint16 param, quint16 value)
+void MIDIOutput::setStreamBandwidth(uint bytesPerSecond, uint maxDelay)
 {
-	this->streamSend(time, EVENT_CONTROL(channel), CC_RPN_MSB,        MIDI_MSB(param));
-	this->streamSend(0,    EVENT_CONTROL(channel), CC_RPN_LSB,        MIDI_LSB(param));
+	QMutexLocker lock(m_channelState.lock());
 
-	this->streamSend(0,    EVENT_CONTROL(channel), CC_DATA_ENTRY_MSB, MIDI_MSB(value));
-	this->streamSend(0,    EVENT_CONTROL(channel), CC_DATA_ENTRY_LSB, MIDI_LSB(value));
+	m_bandwidth = bytesPerSecond;
+	m_maxDelay = maxDelay;
 
-	this->streamSend(0,    EVENT_CONTROL(channel), CC_RPN_MSB,        MIDI_MSB(RPN_RESET));
-//	this->streamSend(0,    EVENT_CONTROL(channel), CC_RPN_LSB,        MIDI_LSB(RPN_RESET));
+	m_streamEvents.clear();
+	m_streamLength = 0;
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIOutput::streamSend(uint time, MIDIMessage message)
+{
+	QMutexLocker lock(m_channelState.lock());
+
+	if (!this->filterShort(true, message))
+	{
+		// keep the timing of whatever comes next
+		if (time)
+			this->streamDelay(time);
+		return;
+	}
+
+	this->trackParam(message);
+	this->trackNote(true, message);
+	this->queueShort(time, message);
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIOutput::streamSend(const MIDITimedMessage *messages, uint count)
+{
+	QMutexLocker lock(m_channelState.lock());
+
+	// carry the time of filtered messages over to the next one instead of adding delays
+	uint time = 0;
+
+	for (uint i = 0; i < count; i++)
+	{
+		const MIDIMessage &message = messages[i].message;
+		time += messages[i].time;
+
+		if (!this->filterShort(true, message))
+			continue;
+
+		this->trackParam(message);
+		this->trackNote(true, message);
+		this->queueShort(time, message);
+		time = 0;
+	}
+
+	if (time)
+		this->streamDelay(time);
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIOutput::streamSend(uint time, const QByteArray &data)
+{
+	QMutexLocker lock(m_channelState.lock());
+
+	this->clearChannelState();
+
+	// ignore messages that are too long (but keep the timing of whatever comes next)
+	if (data.size() >= (1 << 24))
+	{
+		this->streamDelay(time);
+		return;
+	}
+
+	// if the message doesn't fit, keep its time anyway
+	// (the scheduler works with absolute times, so there's nothing to keep in that case)
+	if (!this->streamBuffer(time).addLong(time, data) && !m_bandwidth)
+		m_buffer.addDelay(time);
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIOutput::streamSendRPN(uint time, quint8 channel, quint16 param, quint16 value)
+{
+	this->sendParam(time, channel, CC_RPN_MSB, param, value);
 }
 
 // ------------------------------------------------------------------------------------------------
 void MIDIOutput::streamSendNRPN(uint time, quint8 channel, quint16 param, quint16 value)
 {
-	this->streamSend(time, EVENT_CONTROL(channel), CC_NRPN_MSB,       MIDI_MSB(param));
-	this->streamSend(0,    EVENT_CONTROL(channel), CC_NRPN_LSB,       MIDI_LSB(param));
+	this->sendParam(time, channel, CC_NRPN_MSB, param, value);
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIOutput::streamSetTempo(uint time, double bpm)
+{
+	QMutexLocker lock(m_channelState.lock());
+
+	// ignore tempos that are too low
+	uint tempo = bpm > 0 ? (60 * 1000000) / bpm : 0;
+	if (!tempo || tempo >= (1 << 24))
+	{
+		this->streamDelay(time);
+		return;
+	}
+
+	this->streamBuffer(time).addTempo(time, tempo);
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIOutput::streamDelay(uint time)
+{
+	QMutexLocker lock(m_channelState.lock());
+
+	if (!m_bandwidth)
+		m_buffer.addDelay(time);
+	else
+		m_streamLength += time;
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIOutput::streamSetMarker(uint time, uint value)
+{
+	QMutexLocker lock(m_channelState.lock());
+
+	// ignore values that are too high
+	if (value >= (1 << 24))
+	{
+		this->streamDelay(time);
+		return;
+	}
+
+	this->streamBuffer(time).addMarker(time, value);
+}
+
+// ------------------------------------------------------------------------------------------------
+bool MIDIOutput::streamFlush()
+{
+	QVector<Displaced> displaced;
+
+	// the stream is usually flushed from another thread than the one the device lives on,
+	// which also looks at the flushed buffers (e.g. to tell when one has finished playing)
+	QMutexLocker lock(m_channelState.lock());
+
+	bool playing = this->isStreamPlaying();
+
+	if (m_bandwidth)
+	{
+		if (playing)
+			this->scheduleStream(displaced);
+
+		m_streamEvents.clear();
+		m_streamLength = 0;
+	}
+
+	bool flushed = this->streamFlushBuffer();
+	if (flushed)
+	{
+		if (playing)
+		{
+			// the oldest of the two buffers we know about has finished playing by now
+			m_playingBuffer ^= 1;
+			m_playingNotes[m_playingBuffer] = m_bufferNotes;
+			m_flushedNotes = m_notes[1];
+		}
+		else
+		{
+			// the buffer was thrown away, so none of its notes were ever played
+			m_notes[1] = m_flushedNotes;
+		}
+
+		m_bufferNotes = m_flushedNotes;
+	}
+
+	// (signals are emitted without holding the lock, in case something connected to them
+	// wants to use the device)
+	lock.unlock();
+
+	for (const Displaced &event : displaced)
+	{
+		emit this->streamDisplaced(event.time, event.message.status(), event.message.data1(),
+								   event.delay);
+	}
+
+	return flushed;
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIOutput::streamNotesOff(uint time)
+{
+	QMutexLocker lock(m_channelState.lock());
+
+	// (at most every note and pedal on every channel)
+	MIDITimedMessage messages[16 * 129];
+	uint count = 0;
+
+	auto add = [&](MIDIMessage message)
+	{
+		messages[count].time = count ? 0 : time;
+		messages[count].message = message;
+		count++;
+	};
+
+	for (quint8 channel = 0; channel < 16; channel++)
+	{
+		for (quint8 note = 0; note < 128; note++)
+		{
+			if (m_notes[1].bits[channel][note >> 6] & (1ull << (note & 63)))
+				add(MIDIMessage::noteOff(channel, note));
+		}
+
+		if (m_sustain[1] & (1 << channel))
+			add(MIDIMessage::control(channel, CC_HOLD_PEDAL, 0));
+	}
+
+	if (count)
+		this->streamSend(messages, count);
+	// keep the timing of whatever comes next
+	else if (time)
+		this->streamDelay(time);
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIOutput::sendParam(int time, quint8 channel, quint8 type, quint16 param, quint16 value)
+{
+	// keep other threads from selecting a different parameter in the middle of this
+	QMutexLocker lock(m_channelState.lock());
+
+	// type is the controller for the parameter MSB (the LSB is always the one right before it)
+	auto send = [&](quint8 control, quint8 data)
+	{
+		if (time >= 0)
+		{
+			this->queueShort(time, MIDIMessage::control(channel, control, data));
+			time = 0;
+		}
+		else
+		{
+			this->sendShort(MIDIMessage::control(channel, control, data));
+		}
+	};
+
+	channel &= 0xF;
+
+	if (!m_paramCaching)
+	{
+		send(type,     MIDI_MSB(param));
+		send(type - 1, MIDI_LSB(param));
+
+		send(CC_DATA_ENTRY_MSB, MIDI_MSB(value));
+		send(CC_DATA_ENTRY_LSB, MIDI_LSB(value));
+
+		send(type,     MIDI_MSB(RPN_RESET));
+	//	send(type - 1, MIDI_LSB(RPN_RESET));
+		return;
+	}
+
+	// immediate and streamed messages can't be ordered relative to each other,
+	// so forget what the other one has selected on this channel
+	ParamSelect &curr  = m_params[time >= 0][channel];
+	ParamSelect &other = m_params[time < 0][channel];
+	other.type = 0;
+
+	// only select the parts of the parameter number which have actually changed
+	// (switching between RPN and NRPN always needs both parts)
+	if (curr.type != type || curr.msb != MIDI_MSB(param))
+		send(type,     MIDI_MSB(param));
+	if (curr.type != type || curr.lsb != MIDI_LSB(param))
+		send(type - 1, MIDI_LSB(param));
+
+	curr.type = type;
+	curr.msb = MIDI_MSB(param);
+	curr.lsb = MIDI_LSB(param);
+
+	send(CC_DATA_ENTRY_MSB, MIDI_MSB(value));
+	send(CC_DATA_ENTRY_LSB, MIDI_LSB(value));
+
+	// the parameter is left selected instead of being reset afterwards
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIOutput::trackParam(MIDIMessage message)
+{
+	if (!m_paramCaching || message.type() != MIDIMessage::Control)
+		return;
+
+	// forget the selected parameter if something else selects or resets one
+	switch (message.data1())
+	{
+	case CC_NRPN_LSB:
+	case CC_NRPN_MSB:
+	case CC_RPN_LSB:
+	case CC_RPN_MSB:
+	case CC_ALL_CONTROLLERS_OFF:
+		m_params[0][message.channel()].type = 0;
+		m_params[1][message.channel()].type = 0;
+		break;
+	}
+}
+
+// ------------------------------------------------------------------------------------------------
+bool MIDIOutput::filterShort(bool stream, MIDIMessage message)
+{
+	if (!m_filtering) return true;
+
+	const quint8 data0 = message.status();
+	const quint8 data1 = message.data1();
+	const quint8 data2 = message.data2();
+
+	if (data0 == MIDIMessage::Reset)
+	{
+		this->clearChannelState();
+		return true;
+	}
+	else if (data0 < 0x80 || data0 >= 0xF0)
+	{
+		return true;
+	}
+
+	// immediate and streamed messages can't be ordered relative to each other,
+	// so whatever one of them changes becomes unknown to the other one
+	ChannelState &curr  = m_channels[stream][data0 & 0xF];
+	ChannelState &other = m_channels[!stream][data0 & 0xF];
+
+	switch (message.type())
+	{
+	case MIDIMessage::Control:
+		switch (data1)
+		{
+		// these don't set a value, or their meaning depends on the selected parameter
+		case CC_DATA_ENTRY_MSB:
+		case CC_DATA_ENTRY_LSB:
+		case CC_DATA_BUTTON_INC:
+		case CC_DATA_BUTTON_DEC:
+		case CC_NRPN_LSB:
+		case CC_NRPN_MSB:
+		case CC_RPN_LSB:
+		case CC_RPN_MSB:
+			return true;
+
+		case CC_ALL_CONTROLLERS_OFF:
+			resetControllers(curr);
+			resetControllers(other);
+			return true;
+
+		case CC_BANK_MSB:
+		case CC_BANK_LSB:
+			// a program change is needed for a new bank to take effect
+			if (curr.control[data1] != data2)
+				curr.program = other.program = STATE_UNKNOWN;
+			break;
+		}
+
+		// channel mode messages are always sent
+		if (data1 >= CC_ALL_SOUND_OFF)
+			return true;
+
+		other.control[data1] = STATE_UNKNOWN;
+		if (curr.control[data1] == data2)
+			return false;
+
+		curr.control[data1] = data2;
+		return true;
+
+	case MIDIMessage::Program:
+		other.program = STATE_UNKNOWN;
+		if (curr.program == data1)
+			return false;
+
+		curr.program = data1;
+		return true;
+
+	case MIDIMessage::Pressure:
+		other.pressure = STATE_UNKNOWN;
+		if (curr.pressure == data1)
+			return false;
+
+		curr.pressure = data1;
+		return true;
+
+	case MIDIMessage::Pitch:
+		other.pitch = PITCH_UNKNOWN;
+		if (curr.pitch == message.word())
+			return false;
+
+		curr.pitch = message.word();
+		return true;
+	}
+
+	// notes and key pressure are always sent
+	return true;
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIOutput::resetControllers(ChannelState &state)
+{
+	// forget everything that Reset All Controllers is supposed to reset (according to RP-015)
+	// instead of assuming default values, since not every device agrees on what those are
+	for (int i = 0; i < 120; i++)
+	{
+		switch (i)
+		{
+		case CC_BANK_MSB:
+		case CC_BANK_LSB:
+		case CC_VOLUME_MSB:
+		case CC_PAN_MSB:
+			continue;
+
+		default:
+			if ((i >= CC_SOUND_VARIATION && i <= CC_SOUND_CONTROL10)
+					|| (i >= CC_EFFECTS_LEVEL && i <= CC_PHASER_LEVEL))
+				continue;
+		}
+
+		state.control[i] = STATE_UNKNOWN;
+	}
+
+	state.pressure = STATE_UNKNOWN;
+	state.pitch = PITCH_UNKNOWN;
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIOutput::clearChannelState()
+{
+	QMutexLocker lock(m_channelState.lock());
+
+	for (int i = 0; i < 16; i++)
+	{
+		m_params[0][i].type = 0;
+		m_params[1][i].type = 0;
+	}
+
+	memset(m_channels, STATE_UNKNOWN, sizeof(m_channels));
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIOutput::resetChannelState()
+{
+	// the device was opened or reset, or stream data was thrown away
+	this->clearChannelState();
+	m_channelState.clear();
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIOutput::trackNote(bool stream, MIDIMessage message)
+{
+	// let the channel state know about releases that didn't come from an instrument
+	m_channelState.trackNote(nullptr, message);
+
+	const quint8 channel = message.channel();
+	const quint8 data1 = message.data1();
+	const quint8 data2 = message.data2();
+
+	switch (message.type())
+	{
+	case MIDIMessage::NoteOn:
+		m_notes[stream].set(channel, data1, data2 != 0);
+		if (stream && data2)
+			m_bufferNotes.set(channel, data1, true);
+		break;
+
+	case MIDIMessage::NoteOff:
+		m_notes[stream].set(channel, data1, false);
+		break;
+
+	case MIDIMessage::Control:
+		if (data1 == CC_HOLD_PEDAL)
+		{
+			if (data2 >= 64)
+				m_sustain[stream] |= (1 << channel);
+			else
+				m_sustain[stream] &= ~(1 << channel);
+
+			if (stream && data2 >= 64)
+				m_streamSustain |= (1 << channel);
+		}
+		else if (data1 == CC_ALL_SOUND_OFF || data1 == CC_ALL_NOTES_OFF)
+		{
+			m_notes[stream].bits[channel][0] = 0;
+			m_notes[stream].bits[channel][1] = 0;
+		}
+		else if (data1 == CC_ALL_CONTROLLERS_OFF)
+		{
+			m_sustain[stream] &= ~(1 << channel);
+		}
+		break;
+	}
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIOutput::releaseNotes(bool stream)
+{
+	QMutexLocker lock(m_channelState.lock());
+
+	NoteSet notes = m_notes[stream];
+	quint16 sustain = m_sustain[stream];
+
+	// a stopped stream may have been anywhere in the last two buffers
+	if (stream)
+	{
+		notes |= m_playingNotes[0];
+		notes |= m_playingNotes[1];
+		sustain |= m_streamSustain;
+	}
+
+	// send note-offs directly, bypassing the stream
+	this->beginBatch();
+
+	for (quint8 channel = 0; channel < 16; channel++)
+	{
+		for (quint8 note = 0; note < 128; note++)
+		{
+			if (notes.bits[channel][note >> 6] & (1ull << (note & 63)))
+				this->sendShort(MIDIMessage::noteOff(channel, note));
+		}
+
+		if (sustain & (1 << channel))
+			this->sendShort(MIDIMessage::control(channel, CC_HOLD_PEDAL, 0));
+	}
+
+	this->commitBatch();
+
+	this->forgetNotes(stream);
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIOutput::forgetNotes(bool stream)
+{
+	QMutexLocker lock(m_channelState.lock());
+
+	m_notes[stream].clear();
+	m_sustain[stream] = 0;
+	m_channelState.forgetNotes();
+
+	if (stream)
+	{
+		m_flushedNotes.clear();
+		m_bufferNotes.clear();
+		m_playingNotes[0].clear();
+		m_playingNotes[1].clear();
+		m_streamSustain = 0;
+	}
+}
+
+// ------------------------------------------------------------------------------------------------
+MIDIStreamBuffer& MIDIOutput::streamBuffer(uint &time)
+{
+	if (!m_bandwidth)
+		return m_buffer;
+
+	// the scheduler works with absolute times instead
+	m_streamLength += time;
+	time = m_streamLength;
+
+	return m_streamEvents;
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIOutput::queueShort(uint time, MIDIMessage message)
+{
+	this->streamBuffer(time).addShort(time, message);
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIOutput::resetSchedule(double bpm, uint ppq)
+{
+	// (streamStart() never passes a tempo or timebase of 0)
+	m_ppq = ppq;
+	m_tickTime = (60 * 1000000) / (bpm * ppq);
+
+	m_scheduleTick = 0;
+	m_scheduleClock = 0;
+	m_wireFree = 0;
+}
+
+// ------------------------------------------------------------------------------------------------
+static uint eventSize(MIDIMessage message)
+{
+	const quint8 data0 = message.status();
+
+	switch (data0)
+	{
+	case MIDIMessage::MTCQuarterFrame:
+	case MIDIMessage::SongSelect:
+		return 2;
+
+	case MIDIMessage::SongPosition:
+		return 3;
+	}
+
+	if (data0 >= 0xF0)
+		return 1;
+
+	// program change and channel pressure
+	if ((data0 & 0xE0) == 0xC0)
+		return 2;
+
+	return 3;
+}
+
+// ------------------------------------------------------------------------------------------------
+static bool isDeferrable(MIDIMessage message)
+{
+	const quint8 data1 = message.data1();
+
+	switch (message.type())
+	{
+	case MIDIMessage::Aftertouch:
+	case MIDIMessage::Pressure:
+	case MIDIMessage::Pitch:
+		return true;
+
+	case MIDIMessage::Control:
+		if (data1 == CC_BANK_MSB || data1 == CC_BANK_LSB
+				|| data1 == CC_DATA_ENTRY_MSB || data1 == CC_DATA_ENTRY_LSB)
+			return false;
+
+		// pedals, parameter selection and channel mode messages can't be moved either
+		// (LSB controllers can, but the scheduler always sends them along with their MSB)
+		return data1 < CC_HOLD_PEDAL || (data1 > CC_HOLD2_PEDAL && data1 < CC_DATA_BUTTON_INC);
+	}
+
+	return false;
+}
+
+// ------------------------------------------------------------------------------------------------
+void MIDIOutput::scheduleStream(QVector<Displaced> &displaced)
+{
+	static const QMetaMethod displacedSignal = QMetaMethod::fromSignal(&MIDIOutput::streamDisplaced);
+	bool report = this->isSignalConnected(displacedSignal);
+
+	// time it takes the device to send a single byte (in microseconds)
+	const double byteTime = 1000000.0 / m_bandwidth;
+
+	auto sizeOf = [this](const MIDIStreamEvent &event) -> uint
+	{
+		if (event.type() == MIDIStreamEvent::Short)
+			return eventSize(event.message());
+		else if (event.type() == MIDIStreamEvent::Long)
+			return m_streamEvents.longSize(event);
+
+		return 0;
+	};
+
+	uint tick = 0;
+	double clock = m_scheduleClock;
+
+	auto schedule = [&](const MIDIStreamEvent &event)
+	{
+		m_streamScheduled.append(event);
+		m_streamScheduled.last().time = tick;
+
+		m_wireFree = qMax(m_wireFree, clock) + sizeOf(event) * byteTime;
+
+		if (event.type() == MIDIStreamEvent::Tempo)
+			m_tickTime = double(event.value()) / m_ppq;
+
+		if (report && tick != event.time)
+		{
+			MIDIMessage message;
+			if (event.type() == MIDIStreamEvent::Short)
+				message = event.message();
+
+			displaced.append({uint(m_scheduleTick + event.time), message, int(tick - event.time)});
+		}
+	};
+
+	// (only short messages are ever deferred)
+	auto defer = [&](const MIDIStreamEvent &event)
+	{
+		const MIDIMessage message = event.message();
+
+		// replace an unsent value for the same controller (or pitch bend, etc.)
+		bool perKey = message.type() == MIDIMessage::Control
+				|| message.type() == MIDIMessage::Aftertouch;
+
+		for (int j = 0; j < m_streamDeferred.size(); j++)
+		{
+			const MIDIMessage otherMessage = m_streamDeferred[j].message();
+
+			if (otherMessage.status() == message.status()
+					&& (!perKey || otherMessage.data1() == message.data1()))
+			{
+				if (report)
+					displaced.append({uint(m_scheduleTick + m_streamDeferred[j].time), otherMessage, -1});
+
+				// (the new value goes after everything else, so that an MSB controller and its
+				// LSB controller stay in the order they were last sent in)
+				m_streamDeferred.remove(j);
+				break;
+			}
+		}
+
+		m_streamDeferred.append(event);
+	};
+
+	// find the deferred LSB controller (32-63) which goes with a deferred MSB controller (0-31)
+	auto pairedLSB = [&](int j) -> int
+	{
+		const MIDIMessage message = m_streamDeferred[j].message();
+		if (message.type() != MIDIMessage::Control || message.data1() >= 32)
+			return -1;
+
+		for (int k = j + 1; k < m_streamDeferred.size(); k++)
+		{
+			const MIDIMessage other = m_streamDeferred[k].message();
+			if (other.status() == message.status() && other.data1() == message.data1() + 32)
+				return k;
+		}
+
+		return -1;
+	};
+
+	// send a deferred event, immediately followed by its LSB controller if it has one
+	auto undefer = [&](int j)
+	{
+		int k = pairedLSB(j);
+
+		schedule(m_streamDeferred[j]);
+		if (k >= 0)
+		{
+			schedule(m_streamDeferred[k]);
+			m_streamDeferred.remove(k);
+		}
+		m_streamDeferred.remove(j);
+	};
+
+	m_streamScheduled.clear();
+	m_streamDeferred.clear();
+
+	const uint count = m_streamEvents.size();
+	uint i = 0;
+
+	while (i < count || !m_streamDeferred.isEmpty())
+	{
+		// skip ahead to the next event if nothing is waiting to be sent
+		if (m_streamDeferred.isEmpty() && m_streamEvents[i].time > tick)
+		{
+			clock += (m_streamEvents[i].time - tick) * m_tickTime;
+			tick = m_streamEvents[i].time;
+		}
+
+		// find everything that happens on this tick
+		const uint first = i;
+		uint size = 0;
+		for (; i < count && m_streamEvents[i].time == tick; i++)
+			size += sizeOf(m_streamEvents[i]);
+		for (const MIDIStreamEvent &event : m_streamDeferred)
+			size += sizeOf(event);
+
+		const double tickEnd = clock + m_tickTime;
+
+		if (qMax(m_wireFree, clock) + size * byteTime <= tickEnd
+				|| (i >= count && tick >= m_streamLength))
+		{
+			// everything fits (or the end of the buffer has been reached),
+			// so just send it in the original order
+			for (const MIDIStreamEvent &event : m_streamDeferred)
+				schedule(event);
+			m_streamDeferred.clear();
+
+			for (uint j = first; j < i; j++)
+				schedule(m_streamEvents[j]);
+		}
+		else
+		{
+			// notes and other timing-critical events get the first chance to be sent
+			for (uint j = first; j < i; j++)
+			{
+				const MIDIStreamEvent &event = m_streamEvents[j];
+
+				if (event.type() == MIDIStreamEvent::Short && isDeferrable(event.message()))
+					defer(event);
+				else
+					schedule(event);
+			}
+
+			// send deferred events which can't wait any longer, and then as many others
+			// as will fit before the next tick
+			for (int j = 0; j < m_streamDeferred.size(); )
+			{
+				if (tick - m_streamDeferred[j].time >= m_maxDelay)
+					undefer(j);
+				else j++;
+			}
+
+			while (!m_streamDeferred.isEmpty())
+			{
+				int k = pairedLSB(0);
+				uint size = sizeOf(m_streamDeferred.first());
+				if (k >= 0)
+					size += sizeOf(m_streamDeferred[k]);
+
+				if (qMax(m_wireFree, clock) + size * byteTime > tickEnd)
+					break;
+
+				undefer(0);
+			}
+		}
+
+		clock = tickEnd;
+		tick++;
+	}
+
+	// pass everything along to the device
+	uint lastTime = 0;
+	for (const MIDIStreamEvent &event : m_streamScheduled)
+	{
+		// (if an event doesn't fit, the next one gets its time instead)
+		if (m_buffer.add(event.time - lastTime, event, m_streamEvents))
+			lastTime = event.time;
+	}
+
+	if (m_streamLength > lastTime)
+		m_buffer.addDelay(m_streamLength - lastTime);
 
-	this->streamSend(0,    EVENT_CONTROL(channel), CC_DATA_ENTRY_MSB, MIDI_MSB(value));
-	this->streamSend(0,    EVENT_CONTROL(channel), CC_DATA_ENTRY_LSB, MIDI_LSB(value));
+	// keep track of the time at the end of the buffer
+	if (tick > m_streamLength)
+		clock -= (tick - m_streamLength) * m_tickTime;
+	else
+		clock += (m_streamLength - tick) * m_tickTime;
 
-	this->streamSend(0,    EVENT_CONTROL(channel), CC_NRPN_MSB,       MIDI_MSB(RPN_RESET));
-//	this->streamSend(0,    EVENT_CONTROL(channel), CC_NRPN_LSB,       MIDI_LSB(RPN_RESET));
+	m_scheduleTick += m_streamLength;
+	m_scheduleClock = clock;
 }
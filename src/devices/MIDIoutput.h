@@ -14,9 +14,15 @@
 #define MIDIOUTPUT_H
 
 #include "MIDIdevice.h"
+#include "MIDIchannels.h"
+#include "MIDImessage.h"
+#include "MIDIsink.h"
+#include "MIDIstream.h"
 #include <QList>
+#include <QVector>
+#include <cstring>
 
-class MIDIOutput : public MIDIDevice
+class MIDIOutput : public MIDIDevice, public MIDISink
 {
 	Q_OBJECT
 
@@ -44,6 +50,22 @@ public:
 	 */
 	bool isStreamPlaying() const;
 
+	/* \returns whether or not parameter caching is enabled (see setParamCaching())
+	 */
+	bool paramCaching() const { return m_paramCaching; }
+
+	/* \returns whether or not redundant messages are filtered (see setFiltering())
+	 */
+	bool filtering() const { return m_filtering; }
+
+	/* \returns the bandwidth used by the stream scheduler, or 0 if it is disabled
+	 */
+	uint streamBandwidth() const { return m_bandwidth; }
+
+	/* \returns the shadow state of this device's channels (see MIDIchannels.h)
+	 */
+	MIDIChannelState& channels() { return m_channelState; }
+
 public slots:
 	/* Open an output device for normal (non-streamed) output.
 	 * If the device is already opened for streamed output, it is closed and re-opened first.
@@ -53,16 +75,32 @@ public slots:
 	bool reset();
 
 	/* Sends a MIDI message to the output device.
-	 * \param data0 The MIDI status byte.
-	 * \param data1 The first MIDI data byte (optional).
-	 * \param data2 The second MIDI data byte (optional).
+	 * \param message The MIDI message (see MIDImessage.h).
 	 */
-	void send(quint8 data0, quint8 data1 = 0, quint8 data2 = 0);
+	void send(MIDIMessage message);
+	/* Sends several MIDI messages to the output device at once, in order.
+	 * This is the same as calling send() for each message inside a batch (see beginBatch()).
+	 * \param messages The MIDI messages.
+	 * \param count The number of messages.
+	 */
+	void send(const MIDIMessage *messages, uint count);
 	/* Sends a long MIDI message (e.g. SysEx) to the output device.
 	 * \param data The MIDI message buffer.
 	 */
 	void send(const QByteArray &data);
 
+	/* Begin a batch of messages. While a batch is open, messages passed to send() may be held
+	 * by the output device and delivered all at once when the batch is committed, which is
+	 * much cheaper than delivering them one at a time on some systems.
+	 * Only messages sent to this device from the same thread are held.
+	 * Batches can be nested; only committing the outermost batch delivers the messages.
+	 */
+	void beginBatch();
+	/* Commit the current batch of messages started with beginBatch().
+	 * \returns whether or not the messages were delivered successfully
+	 */
+	bool commitBatch();
+
 	/* Send a RPN or NRPN to a specific channel. These are helper methods to send().
 	 * \param channel The MIDI channel number (0-15).
 	 * \param param The RPN or NRPN parameter number. See MIDIdefs.h for valid RPN numbers.
@@ -71,6 +109,41 @@ public slots:
 	void sendRPN(quint8 channel, quint16 param, quint16 value);
 	void sendNRPN(quint8 channel, quint16 param, quint16 value);
 
+	/* Enable or disable parameter caching for sendRPN(), sendNRPN() and their stream versions.
+	 * When enabled, the parameter selected on each channel is remembered and left selected
+	 * afterwards, so repeated changes to the same parameter only need the two data entry messages.
+	 * Selecting parameters directly with send() still works, but sending parameters on the same
+	 * channel with both send() and streamSend() while a stream is playing is not supported.
+	 * Caching is disabled by default.
+	 */
+	void setParamCaching(bool enable);
+
+	/* Enable or disable filtering of redundant messages. When enabled, the current value of each
+	 * controller, program, channel pressure and pitch bend on each channel is remembered, and
+	 * messages which would not change it are dropped (streamed messages are replaced with a delay
+	 * so the timing of later messages is unaffected). Bank selects always let the next program
+	 * change through. Notes, channel mode messages and data entry are never filtered.
+	 * All remembered state is forgotten when the device is opened or reset, when any SysEx
+	 * message is sent, and (mostly) when Reset All Controllers is sent.
+	 * Filtering is disabled by default.
+	 */
+	void setFiltering(bool enable);
+
+	/* Enable or disable the stream scheduler for devices with limited bandwidth.
+	 * When enabled, each buffer is rearranged by streamFlush() so that notes and other
+	 * timing-critical messages are sent on time even when there is more data at once than the
+	 * device can actually deliver. Continuous controllers, pitch bend and pressure are moved to
+	 * later ticks when the device is busy, and an unsent value is replaced if a newer value for
+	 * the same controller comes along before it can be sent. Moved events are reported with
+	 * streamDisplaced().
+	 * This should be called before the stream is started.
+	 *
+	 * \param bytesPerSecond the bandwidth of the device (3125 for a standard MIDI port),
+	 *        or 0 to disable scheduling (the default)
+	 * \param maxDelay the maximum number of ticks an event may be moved by
+	 */
+	void setStreamBandwidth(uint bytesPerSecond, uint maxDelay = 12);
+
 	/* Open the device in stream mode. If the device is already opened for normal output,
 	 * it is closed and re-opened first. The stream can still be closed using close().
 	 *
@@ -92,11 +165,15 @@ public slots:
 	 * a timestamp that specifies the time (in ticks) that this message occurs relative to the
 	 * previous message (like in a standard MIDI file).
 	 * \param time the timestamp of the message (in ticks).
-	 * \param data0 The MIDI status byte.
-	 * \param data1 The first MIDI data byte (optional).
-	 * \param data2 The second MIDI data byte (optional).
+	 * \param message The MIDI message (see MIDImessage.h).
+	 */
+	void streamSend(uint time, MIDIMessage message);
+	/* Send several short MIDI messages to the stream at once, in order.
+	 * This is the same as calling streamSend() for each message, but cheaper.
+	 * \param messages The MIDI messages, each with a timestamp relative to the previous one.
+	 * \param count The number of messages.
 	 */
-	void streamSend(uint time, quint8 data0, quint8 data1 = 0, quint8 data2 = 0);
+	void streamSend(const MIDITimedMessage *messages, uint count);
 	/* Send a long MIDI message to the stream. This is analogous to send(), but with
 	 * a timestamp that specifies the time (in ticks) that this message occurs relative to the
 	 * previous message (like in a standard MIDI file.
@@ -121,6 +198,13 @@ public slots:
 	 */
 	void streamSetTempo(uint time, double bpm);
 
+	/* Send note-off events to the stream for every note which is still on at the end of the
+	 * stream (and release the sustain pedal wherever it's held), e.g. when jumping to a different
+	 * position in a song. Only the notes which are actually on are turned off.
+	 * \param time the timestamp of the first message (in ticks).
+	 */
+	void streamNotesOff(uint time);
+
 	/* Send a null event with a specified timestamp. Use this to pad out the event buffer
 	 * to the desired length.
 	 * \param time the timestamp of the message (in ticks).
@@ -161,13 +245,130 @@ public slots:
 	 */
 	bool streamStop();
 
+	/* Check how far the stream has played, and emit streamReady() and streamMarker() as needed.
+	 * This may be called from any thread (usually the platform's input thread or callback).
+	 * This should only be called by the platform-specific implementation.
+	 */
+	void streamUpdate();
+
 signals:
 	void streamReady();
 	void streamMarker(uint);
 
+	/* Emitted by streamFlush() for each event which was moved by the stream scheduler.
+	 * \param time the event's original stream time (in ticks)
+	 * \param delay how many ticks later the event will be sent, or -1 if it was dropped
+	 *        in favor of a newer value
+	 */
+	void streamDisplaced(uint time, quint8 data0, quint8 data1, int delay);
+
 private:
 	struct OutputInfo *m_info;
-	QByteArray m_buffer;
+	// stream events waiting to be flushed (translated by the platform in streamFlushBuffer())
+	MIDIStreamBuffer m_buffer;
+
+	// last RPN/NRPN selected on each channel by immediate and streamed messages
+	// (type is the parameter MSB controller number, or 0 if unknown)
+	struct ParamSelect
+	{
+		quint8 type, msb, lsb;
+	};
+	bool m_paramCaching = false;
+	ParamSelect m_params[2][16] = {};
+
+	// last known state of each channel for immediate and streamed messages
+	// (all bits set if a value hasn't been sent yet)
+	enum { STATE_UNKNOWN = 0xFF, PITCH_UNKNOWN = 0xFFFF };
+	struct ChannelState
+	{
+		quint8 control[120];
+		quint8 program, pressure;
+		quint16 pitch;
+	};
+	bool m_filtering = false;
+	ChannelState m_channels[2][16];
+
+	// notes which are on for each channel
+	struct NoteSet
+	{
+		quint64 bits[16][2];
+
+		void clear()
+		{
+			memset(bits, 0, sizeof(bits));
+		}
+		void set(quint8 channel, quint8 note, bool on)
+		{
+			quint64 bit = 1ull << (note & 63);
+			if (on)
+				bits[channel & 0xF][(note >> 6) & 1] |= bit;
+			else
+				bits[channel & 0xF][(note >> 6) & 1] &= ~bit;
+		}
+		NoteSet& operator|=(const NoteSet &other)
+		{
+			for (int i = 0; i < 16; i++)
+			{
+				bits[i][0] |= other.bits[i][0];
+				bits[i][1] |= other.bits[i][1];
+			}
+			return *this;
+		}
+	};
+	// notes which are on for immediate messages, and at the end of the stream
+	NoteSet m_notes[2] = {};
+	// channels where the sustain pedal is held for immediate messages, and at the end of the stream
+	quint16 m_sustain[2] = {};
+	// notes which are on at the end of the last flushed buffer, notes which were on at any time
+	// during the buffer being filled and the last two flushed buffers (any of which may still be
+	// playing), and channels where the sustain pedal has been held since the stream started
+	NoteSet m_flushedNotes = {}, m_bufferNotes = {}, m_playingNotes[2] = {};
+	uint m_playingBuffer = 0;
+	quint16 m_streamSustain = 0;
+
+	// also locked while using any of the above
+	MIDIChannelState m_channelState;
+
+	// stream events held for the scheduler until the buffer is flushed
+	// (with absolute times from the start of the buffer)
+	uint m_bandwidth = 0, m_maxDelay = 0;
+	MIDIStreamBuffer m_streamEvents;
+	QVector<MIDIStreamEvent> m_streamScheduled, m_streamDeferred;
+	uint m_streamLength = 0;
+	// events moved by the scheduler, which streamFlush() reports after unlocking
+	struct Displaced
+	{
+		uint time;
+		MIDIMessage message;
+		int delay;
+	};
+	// stream time (in ticks and microseconds) at the start of the current buffer,
+	// and the time when the device is done sending everything scheduled so far
+	quint64 m_scheduleTick = 0;
+	double m_scheduleClock = 0, m_wireFree = 0;
+	double m_tickTime = 0;
+	uint m_ppq = 0;
+
+	// platform-specific output of messages
+	void sendShort(MIDIMessage message);
+	void sendLong(const QByteArray &data);
+	bool streamFlushBuffer();
+
+	void sendParam(int time, quint8 channel, quint8 type, quint16 param, quint16 value);
+	void trackParam(MIDIMessage message);
+	bool filterShort(bool stream, MIDIMessage message);
+	static void resetControllers(ChannelState &state);
+	void clearChannelState();
+	void resetChannelState();
+
+	void trackNote(bool stream, MIDIMessage message);
+	void releaseNotes(bool stream);
+	void forgetNotes(bool stream);
+
+	MIDIStreamBuffer& streamBuffer(uint &time);
+	void queueShort(uint time, MIDIMessage message);
+	void resetSchedule(double bpm, uint ppq);
+	void scheduleStream(QVector<Displaced> &displaced);
 
 	static QList<MIDIOutput*> devices;
 };
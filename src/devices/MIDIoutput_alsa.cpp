@@ -1,12 +1,19 @@
 /*
- * MIDI output device implementation for ALSA (unfinished)
+ * MIDI output device implementation for ALSA
  */
 
 #include "MIDIoutput.h"
+#include "MIDIdefs.h"
 #include "alsa.h"
 
-// stream buffer size has to be less than 64kb (but not exactly 64kb)
-#define STREAM_BUF_SIZE ((1 << 16) - sizeof(DWORD))
+#include <QAtomicInt>
+#include <QAtomicPointer>
+#include <QMutex>
+#include <QPair>
+#include <QThread>
+#include <QVarLengthArray>
+
+#include <cerrno>
 
 #define TEST(rc, ...) \
 	do if (0 > rc) \
@@ -20,17 +27,271 @@ QList<MIDIOutput*> MIDIOutput::devices;
 struct OutputInfo
 {
 	int client, port;
+	bool opened = false;
 
 	snd_seq_port_info_t *portInfo = nullptr;
 	snd_seq_port_subscribe_t *subsInfo = nullptr;
 
+	// only used for messages which aren't encoded directly
 	snd_midi_event_t *encoder = nullptr;
-
-	// TODO
+	QMutex encoderLock;
+
+	// nesting level of beginBatch() calls, the thread which called it, and the short events
+	// it has sent since then (which are only used while holding ALSA::outputLock)
+	QAtomicInt batchDepth;
+	QAtomicPointer<QThread> batchThread;
+	QVarLengthArray<snd_seq_event_t, 64> batch;
+
+	/* Stream-related info */
+	int queue = -1;
+	// absolute queue time at the end of all flushed stream data
+	snd_seq_tick_time_t streamTick = 0;
+	// absolute queue time at the end of each buffer, and whether it hasn't finished playing yet
+	snd_seq_tick_time_t bufferEnd[2];
+	bool bufferQueued[2];
 	uint currHeader;
 	bool streamPlaying;
+	// markers which have been flushed to the queue but not reached yet
+	QList<QPair<snd_seq_tick_time_t, uint>> markers;
 };
 
+// ------------------------------------------------------------------------------------------------
+void MIDIOutput::streamUpdate()
+{
+	OutputInfo *info = m_info;
+	QList<uint> markers;
+	int ready = 0;
+
+	{
+		// (the markers and buffers are also used by streamFlush(), which may be on another thread)
+		QMutexLocker lock(m_channelState.lock());
+
+		// (echo events may still arrive after the stream was stopped)
+		if (info->queue < 0 || !info->streamPlaying)
+			return;
+
+		snd_seq_tick_time_t tick = this->streamTime();
+
+		while (!info->markers.isEmpty() && info->markers.first().first <= tick)
+		{
+			markers.append(info->markers.takeFirst().second);
+		}
+
+		// the current buffer is always the one which was flushed least recently
+		for (int i = 0; i < 2; i++)
+		{
+			uint buffer = info->currHeader ^ i;
+
+			if (!info->bufferQueued[buffer] || tick < info->bufferEnd[buffer])
+				break;
+
+			info->bufferQueued[buffer] = false;
+			ready++;
+		}
+	}
+
+	// (signals are emitted without holding the lock, in case something connected to them
+	// wants to lock something else first)
+	for (uint marker : markers)
+		emit this->streamMarker(marker);
+
+	// notify the host application to populate the next buffer
+	while (ready--)
+		emit this->streamReady();
+}
+
+// ------------------------------------------------------------------------------------------------
+static bool encodeShort(OutputInfo *info, snd_seq_event_t *event, MIDIMessage message)
+{
+	const quint8 channel = message.channel();
+	const quint8 data1 = message.data1();
+	const quint8 data2 = message.data2();
+
+	// build channel messages directly
+	switch (message.type())
+	{
+	case MIDIMessage::NoteOff:
+		snd_seq_ev_set_noteoff(event, channel, data1, data2);
+		return true;
+
+	case MIDIMessage::NoteOn:
+		snd_seq_ev_set_noteon(event, channel, data1, data2);
+		return true;
+
+	case MIDIMessage::Aftertouch:
+		snd_seq_ev_set_keypress(event, channel, data1, data2);
+		return true;
+
+	case MIDIMessage::Control:
+		snd_seq_ev_set_controller(event, channel, data1, data2);
+		return true;
+
+	case MIDIMessage::Program:
+		snd_seq_ev_set_pgmchange(event, channel, data1);
+		return true;
+
+	case MIDIMessage::Pressure:
+		snd_seq_ev_set_chanpress(event, channel, data1);
+		return true;
+
+	case MIDIMessage::Pitch:
+		snd_seq_ev_set_pitchbend(event, channel, message.word() - 0x2000);
+		return true;
+	}
+
+	// use the encoder for system messages
+	uchar data[3];
+	data[0] = message.status(); data[1] = data1; data[2] = data2;
+
+	QMutexLocker lock(&info->encoderLock);
+	snd_midi_event_reset_encode(info->encoder);
+	snd_midi_event_encode(info->encoder, data, 3, event);
+
+	return event->type != SND_SEQ_EVENT_NONE;
+}
+
+// ------------------------------------------------------------------------------------------------
+static bool encodeLong(OutputInfo *info, snd_seq_event_t *event, const QByteArray &data)
+{
+	if (data.isEmpty()) return false;
+
+	// SysEx data is passed along as-is
+	if ((quint8)data[0] == EVENT_SYSEX_START)
+	{
+		snd_seq_ev_set_sysex(event, data.size(), (void*)data.constData());
+		return true;
+	}
+
+	QMutexLocker lock(&info->encoderLock);
+	snd_midi_event_reset_encode(info->encoder);
+	snd_midi_event_encode(info->encoder, (const uchar*)data.constData(), data.size(), event);
+
+	return event->type != SND_SEQ_EVENT_NONE;
+}
+
+// ------------------------------------------------------------------------------------------------
+static int outputBatch(OutputInfo *info)
+{
+	// (the caller holds ALSA::outputLock)
+	if (info->batch.isEmpty()) return 0;
+
+	// pass on whatever else is in the output buffer first, so that only this device's events
+	// are in it while the batch is delivered all at once
+	int rc = snd_seq_drain_output(ALSA::seq_handle);
+
+	for (int i = 0; i < info->batch.size() && rc >= 0; i++)
+		rc = snd_seq_event_output(ALSA::seq_handle, &info->batch[i]);
+
+	if (rc >= 0)
+		rc = snd_seq_drain_output(ALSA::seq_handle);
+
+	info->batch.clear();
+	return rc;
+}
+
+// ------------------------------------------------------------------------------------------------
+static int outputEvent(OutputInfo *info, snd_seq_event_t *event)
+{
+	QMutexLocker lock(&ALSA::outputLock);
+
+	// while a batch is open, hold on to the event until the batch is committed
+	// (events sent from other threads, e.g. MIDI thru, are still sent right away)
+	if (info->batchThread.loadAcquire() == QThread::currentThread())
+	{
+		if (!snd_seq_ev_is_variable(event))
+		{
+			info->batch.append(*event);
+			return 0;
+		}
+
+		// long events point to data which may be gone by the time the batch is committed,
+		// so send everything before them now instead
+		int rc = outputBatch(info);
+		if (rc < 0) return rc;
+	}
+
+	return snd_seq_event_output_direct(ALSA::seq_handle, event);
+}
+
+// ------------------------------------------------------------------------------------------------
+static void setEcho(OutputInfo *info, snd_seq_event_t *event)
+{
+	// echo events are sent back to our own input port, where the input thread passes them
+	// to streamUpdate() (the first data word tells it which device they belong to)
+	event->type = SND_SEQ_EVENT_ECHO;
+	event->data.raw32.d[0] = (info->client << 8) | info->port;
+	snd_seq_ev_set_dest(event, ALSA::seq_client, ALSA::seq_inport);
+}
+
+// ------------------------------------------------------------------------------------------------
+static int outputScheduled(snd_seq_event_t *event)
+{
+	QMutexLocker lock(&ALSA::outputLock);
+
+	int rc = snd_seq_event_output(ALSA::seq_handle, event);
+	if (rc == -EAGAIN)
+	{
+		// if the output buffer is full, pass it on to the sequencer and try once more
+		// (if the sequencer's pool is full too, the caller gives up until the next buffer)
+		rc = snd_seq_drain_output(ALSA::seq_handle);
+		if (rc >= 0 || rc == -EAGAIN)
+			rc = snd_seq_event_output(ALSA::seq_handle, event);
+	}
+
+	return rc;
+}
+
+// ------------------------------------------------------------------------------------------------
+static int outputEcho(OutputInfo *info, snd_seq_tick_time_t tick)
+{
+	snd_seq_event_t ev;
+	snd_seq_ev_clear(&ev);
+
+	setEcho(info, &ev);
+	snd_seq_ev_set_source(&ev, ALSA::seq_outport);
+	snd_seq_ev_schedule_tick(&ev, info->queue, 0, tick);
+
+	return outputScheduled(&ev);
+}
+
+// ------------------------------------------------------------------------------------------------
+static int outputRoom()
+{
+	// (how many more events the sequencer can hold for us, or a negative error code)
+	snd_seq_client_pool_t *pool;
+	snd_seq_client_pool_alloca(&pool);
+
+	QMutexLocker lock(&ALSA::outputLock);
+
+	int rc = snd_seq_get_client_pool(ALSA::seq_handle, pool);
+	if (rc < 0) return rc;
+
+	return snd_seq_client_pool_get_output_free(pool);
+}
+
+// ------------------------------------------------------------------------------------------------
+static int drainOutput()
+{
+	QMutexLocker lock(&ALSA::outputLock);
+	return snd_seq_drain_output(ALSA::seq_handle);
+}
+
+// ------------------------------------------------------------------------------------------------
+static int controlQueue(int queue, int type)
+{
+	// (queue control events go through the output buffer too)
+	QMutexLocker lock(&ALSA::outputLock);
+	return snd_seq_control_queue(ALSA::seq_handle, queue, type, 0, nullptr);
+}
+
+// ------------------------------------------------------------------------------------------------
+static int removeEvents(snd_seq_remove_events_t *remove)
+{
+	// (this also throws away matching events that are still in the output buffer)
+	QMutexLocker lock(&ALSA::outputLock);
+	return snd_seq_remove_events(ALSA::seq_handle, remove);
+}
+
 // ------------------------------------------------------------------------------------------------
 void MIDIOutput::enumerate()
 {
@@ -84,7 +345,7 @@ MIDIOutput::MIDIOutput(uint id)
 	snd_seq_port_subscribe_set_sender(m_info->subsInfo, &src);
 	snd_seq_port_subscribe_set_dest(m_info->subsInfo, &dest);
 
-	// allocate/init MIDI event encoder (for short events only)
+	// allocate/init MIDI event encoder (for short system events only)
 	rc = snd_midi_event_new(3, &m_info->encoder);
 	TEST(rc);
 	snd_midi_event_reset_encode(m_info->encoder);
@@ -130,14 +391,22 @@ bool MIDIOutput::open()
 		return false;
 	}
 
+	// close the device if it's already open (as a normal or streamed output)
+	if (!this->close())
+		return false;
+
 	int rc;
 
+	// events are addressed to the device directly (so several devices can be used at once),
+	// but the subscription still shows the connection to anyone else looking at it
 	rc = snd_seq_subscribe_port(ALSA::seq_handle, m_info->subsInfo);
 	TEST(rc, false);
 
+	m_info->opened = true;
+	this->resetChannelState();
 	emit this->opened();
 
-	// TODO
+	// device was opened successfully
 	return true;
 }
 
@@ -148,11 +417,27 @@ bool MIDIOutput::close()
 
 	int rc;
 
-	// TODO
+	// closing a stream output?
+	if (m_info->queue >= 0)
+	{
+		this->streamStop();
+
+		rc = snd_seq_free_queue(ALSA::seq_handle, m_info->queue);
+		TEST(rc, false);
+
+		m_info->queue = -1;
+		ALSA::removeOutput((m_info->client << 8) | m_info->port);
+	}
+
+	// do nothing else if device was closed already
+	if (!m_info->opened) return true;
+
+	this->reset();
 
 	rc = snd_seq_unsubscribe_port(ALSA::seq_handle, m_info->subsInfo);
 	TEST(rc, false);
 
+	m_info->opened = false;
 	emit this->closed();
 
 	// device was closed
@@ -162,117 +447,245 @@ bool MIDIOutput::close()
 // ------------------------------------------------------------------------------------------------
 bool MIDIOutput::reset()
 {
-	int rc = snd_seq_drop_output(ALSA::seq_handle);
+	// remove only this device's pending events (other devices share the same client)
+	snd_seq_addr_t dest;
+	dest.client = m_info->client;
+	dest.port   = m_info->port;
+
+	snd_seq_remove_events_t *remove;
+	snd_seq_remove_events_alloca(&remove);
+	snd_seq_remove_events_set_dest(remove, &dest);
+	snd_seq_remove_events_set_condition(remove, SND_SEQ_REMOVE_OUTPUT | SND_SEQ_REMOVE_DEST);
+
+	int rc = removeEvents(remove);
 	TEST(rc, false);
 
-	// TODO: maybe turn off all notes
+	{
+		QMutexLocker lock(&ALSA::outputLock);
+		m_info->batch.clear();
+	}
+
+	// turn off any notes which were left on
+	this->releaseNotes(false);
+	this->releaseNotes(true);
+
+	this->resetChannelState();
 
 	return true;
 }
 
 // ------------------------------------------------------------------------------------------------
-void MIDIOutput::send(quint8 data0, quint8 data1, quint8 data2)
+void MIDIOutput::sendShort(MIDIMessage message)
 {
 	int rc;
 
-	uchar data[3];
-	data[0] = data0; data[1] = data1; data[2] = data2;
-
 	snd_seq_event_t ev;
 	snd_seq_ev_clear(&ev);
 
+	if (!encodeShort(m_info, &ev, message))
+		return;
+
 	snd_seq_ev_set_source(&ev, ALSA::seq_outport);
-	snd_seq_ev_set_subs(&ev);
+	snd_seq_ev_set_dest(&ev, m_info->client, m_info->port);
 	snd_seq_ev_set_direct(&ev);
 
-	snd_midi_event_encode(m_info->encoder, data, 3, &ev);
-
-	rc = snd_seq_event_output_direct(ALSA::seq_handle, &ev);
+	rc = outputEvent(m_info, &ev);
 	TEST(rc);
 }
 
 // ------------------------------------------------------------------------------------------------
-void MIDIOutput::send(const QByteArray &data)
+void MIDIOutput::sendLong(const QByteArray &data)
 {
 	int rc;
 
 	snd_seq_event_t ev;
 	snd_seq_ev_clear(&ev);
 
-	snd_seq_ev_set_source(&ev, m_info->port);
-	snd_seq_ev_set_subs(&ev);
-	snd_seq_ev_set_direct(&ev);
+	if (!encodeLong(m_info, &ev, data))
+		return;
 
-	snd_midi_event_encode(m_info->encoder, (const uchar*)data.constData(), data.size(), &ev);
+	snd_seq_ev_set_source(&ev, ALSA::seq_outport);
+	snd_seq_ev_set_dest(&ev, m_info->client, m_info->port);
+	snd_seq_ev_set_direct(&ev);
 
-	rc = snd_seq_event_output_direct(ALSA::seq_handle, &ev);
+	rc = outputEvent(m_info, &ev);
 	TEST(rc);
 }
 
 // ------------------------------------------------------------------------------------------------
-bool MIDIOutput::streamOpen()
+void MIDIOutput::beginBatch()
 {
-	// TODO
-
-	m_info->streamPlaying = false;
-
-	// prepare double buffers
-	// TODO
-
-	return this->open();
+	if (m_info->batchDepth.fetchAndAddOrdered(1) == 0)
+		m_info->batchThread.storeRelease(QThread::currentThread());
 }
 
 // ------------------------------------------------------------------------------------------------
-void MIDIOutput::streamSend(uint time, quint8 data0, quint8 data1, quint8 data2)
+bool MIDIOutput::commitBatch()
 {
-	// TODO
-}
+	int depth;
+	do
+	{
+		depth = m_info->batchDepth.loadAcquire();
+		if (!depth) return false;
+	} while (!m_info->batchDepth.testAndSetOrdered(depth, depth - 1));
 
-// ------------------------------------------------------------------------------------------------
-void MIDIOutput::streamSend(uint time, const QByteArray &data)
-{
-	// TODO
-}
+	// deliver everything held for the batch at once
+	if (depth == 1)
+	{
+		QMutexLocker lock(&ALSA::outputLock);
 
-// ------------------------------------------------------------------------------------------------
-void MIDIOutput::streamSetTempo(uint time, double bpm)
-{
-	// TODO
-}
+		// (unless another thread has already started a new batch in the meantime)
+		m_info->batchThread.testAndSetOrdered(QThread::currentThread(), nullptr);
 
-// ------------------------------------------------------------------------------------------------
-void MIDIOutput::streamDelay(uint time)
-{
-	// TODO
+		int rc = outputBatch(m_info);
+		lock.unlock();
+		TEST(rc, false);
+	}
+
+	return true;
 }
 
 // ------------------------------------------------------------------------------------------------
-void MIDIOutput::streamSetMarker(uint time, uint value)
+bool MIDIOutput::streamOpen()
 {
-	// TODO
+	// close the device if it's already open (as a normal or streamed output)
+	if (!this->open())
+		return false;
+
+	int rc;
+
+	rc = snd_seq_alloc_named_queue(ALSA::seq_handle, "Decomposer stream");
+	TEST(rc, false);
+	m_info->queue = rc;
+
+	m_info->streamPlaying = false;
+
+	// finished buffers and markers are reported by the input thread
+	ALSA::addOutput((m_info->client << 8) | m_info->port, this);
+
+	// prepare double buffers
+	m_info->currHeader = 0;
+	for (int i = 0; i < 2; i++)
+	{
+		m_info->bufferEnd[i] = 0;
+		m_info->bufferQueued[i] = false;
+	}
+
+	return true;
 }
 
 // ------------------------------------------------------------------------------------------------
-bool MIDIOutput::streamFlush()
+bool MIDIOutput::streamFlushBuffer()
 {
-	// if current MIDI stream buffer is ready for more data, dump the QByteArray into it
-	// and switch to the other stream buffer
+	// if current MIDI stream buffer is ready for more data, schedule everything in the buffer
+	// on the sequencer queue and switch to the other stream buffer
 
-	// TODO
+	uint buffer = m_info->currHeader;
 
 	if (!m_info->streamPlaying)
 	{
+		// anything selected by the discarded events was never sent
 		m_buffer.clear();
+		this->resetChannelState();
 		return true;
 	}
-	else if (false /* TODO */)
+	else if (!m_info->bufferQueued[buffer])
 	{
-		// TODO
-		m_buffer.clear();
+		int rc = 0;
+		snd_seq_tick_time_t tick = m_info->streamTick;
+
+		// don't send more than the sequencer can hold right now (keeping room for the echo event
+		// at the end of the buffer); whatever is left over is sent with the next buffer instead
+		int room = outputRoom();
+		TEST(room, false);
+		room--;
 
-		// TODO
+		uint sent = 0;
+		for (const MIDIStreamEvent &event : m_buffer)
+		{
+			snd_seq_event_t ev;
+			snd_seq_ev_clear(&ev);
+
+			bool valid = false;
+
+			switch (event.type())
+			{
+			case MIDIStreamEvent::Short:
+				valid = encodeShort(m_info, &ev, event.message());
+				snd_seq_ev_set_dest(&ev, m_info->client, m_info->port);
+				break;
+
+			case MIDIStreamEvent::Long:
+				// (SysEx data is copied into the output buffer along with the event)
+				valid = encodeLong(m_info, &ev, QByteArray::fromRawData(m_buffer.longData(event),
+																		m_buffer.longSize(event)));
+				snd_seq_ev_set_dest(&ev, m_info->client, m_info->port);
+				break;
+
+			case MIDIStreamEvent::Tempo:
+				snd_seq_ev_set_queue_tempo(&ev, m_info->queue, event.value());
+				valid = true;
+				break;
+
+			case MIDIStreamEvent::Marker:
+				// markers are never sent to the device, but the queue echoes them back to us
+				// so we know when they are reached
+				setEcho(m_info, &ev);
+				valid = true;
+				break;
+
+			default:
+				break;
+			}
+
+			// (events which can't be sent are skipped, but their delays still count)
+			if (valid)
+			{
+				// (long events take up as many pool cells as their data needs)
+				room -= (snd_seq_event_length(&ev) + sizeof(ev) - 1) / sizeof(ev);
+				if (room < 0)
+					break;
+
+				snd_seq_ev_set_source(&ev, ALSA::seq_outport);
+				snd_seq_ev_schedule_tick(&ev, m_info->queue, 0, tick + event.time);
+
+				rc = outputScheduled(&ev);
+				if (rc < 0) break;
+
+				if (event.type() == MIDIStreamEvent::Marker)
+					m_info->markers.append(qMakePair(tick + event.time, (uint)event.value()));
+			}
+
+			// convert relative time to absolute queue time
+			tick += event.time;
+			sent++;
+		}
 
+		if (rc == -EAGAIN)
+		{
+			// the pool filled up anyway (e.g. because of another stream), so keep the rest
+			rc = 0;
+		}
+
+		if (rc < 0)
+			m_buffer.clear();
+		else
+			m_buffer.removeFirst(sent);
+
+		m_info->streamTick = tick;
+		m_info->bufferEnd[buffer] = tick;
+		m_info->bufferQueued[buffer] = true;
 		m_info->currHeader ^= 1;
+
+		TEST(rc, false);
+
+		// find out when this buffer has finished playing
+		rc = outputEcho(m_info, tick);
+		TEST(rc, false);
+
+		rc = drainOutput();
+		TEST(rc, false);
+
 		return true;
 	}
 
@@ -282,25 +695,61 @@ bool MIDIOutput::streamFlush()
 // ------------------------------------------------------------------------------------------------
 bool MIDIOutput::streamStart(double bpm, uint ppq)
 {
-	ulong time = this->streamTime();
+	if (m_info->queue < 0)
+	{
+		emit this->error(tr("tried to start a stream on a device not opened for streaming"));
+		return false;
+	}
+	if (bpm <= 0 || !ppq)
+	{
+		emit this->error(tr("tried to start a stream with an invalid tempo or timebase"));
+		return false;
+	}
 
-	// TODO
-	emit this->error("not implemented yet");
-	return false;
+	// (the stream may be flushed from another thread in the meantime)
+	QMutexLocker lock(m_channelState.lock());
+
+	int rc;
+	ulong time = this->streamTime();
 
 	// if stream is just now being started, prompt host application to fill both stream buffers
 	if (time == 0)
 	{
 		// set default tempo and timebase
-		// TODO
+		snd_seq_queue_tempo_t *tempo;
+		snd_seq_queue_tempo_alloca(&tempo);
+		snd_seq_queue_tempo_set_tempo(tempo, (60 * 1000000) / bpm);
+		snd_seq_queue_tempo_set_ppq(tempo, ppq);
 
+		rc = snd_seq_set_queue_tempo(ALSA::seq_handle, m_info->queue, tempo);
+		TEST(rc, false);
+
+		m_info->streamTick = 0;
 		m_info->currHeader = 0;
+		m_info->markers.clear();
+		this->resetSchedule(bpm, ppq);
 
+		// treat both buffers as finished, so streamReady() is emitted for both of them
 		for (int i = 0; i < 2; i++)
 		{
-			// TODO
+			m_info->bufferEnd[i] = 0;
+			m_info->bufferQueued[i] = true;
 		}
+
+		rc = controlQueue(m_info->queue, SND_SEQ_EVENT_START);
+		TEST(rc, false);
+
+		// (both buffers are reported as soon as the queue starts)
+		rc = outputEcho(m_info, 0);
 	}
+	else
+	{
+		rc = controlQueue(m_info->queue, SND_SEQ_EVENT_CONTINUE);
+	}
+	TEST(rc, false);
+
+	rc = drainOutput();
+	TEST(rc, false);
 
 	m_info->streamPlaying = true;
 	return true;
@@ -309,35 +758,73 @@ bool MIDIOutput::streamStart(double bpm, uint ppq)
 // ------------------------------------------------------------------------------------------------
 bool MIDIOutput::streamPause()
 {
-	// TODO
-	emit this->error("not implemented yet");
+	if (m_info->queue < 0) return false;
 
-	return false;
+	int rc = controlQueue(m_info->queue, SND_SEQ_EVENT_STOP);
+	TEST(rc, false);
+
+	rc = drainOutput();
+	TEST(rc, false);
+
+	return true;
 }
 
 // ------------------------------------------------------------------------------------------------
 bool MIDIOutput::streamStop()
 {
-	// TODO
-	emit this->error("not implemented yet");
+	if (m_info->queue < 0) return false;
+
+	QMutexLocker lock(m_channelState.lock());
+
+	int rc;
 
 	m_info->streamPlaying = false;
+	m_info->markers.clear();
+	this->resetChannelState();
+
+	rc = controlQueue(m_info->queue, SND_SEQ_EVENT_STOP);
+	TEST(rc, false);
+
+	// remove everything which hasn't been played yet
+	snd_seq_remove_events_t *remove;
+	snd_seq_remove_events_alloca(&remove);
+	snd_seq_remove_events_set_queue(remove, m_info->queue);
+	snd_seq_remove_events_set_condition(remove, SND_SEQ_REMOVE_OUTPUT);
+
+	rc = removeEvents(remove);
+	TEST(rc, false);
+
+	// rewind the queue so the stream can be restarted from the beginning
+	rc = controlQueue(m_info->queue, SND_SEQ_EVENT_SETPOS_TICK);
+	TEST(rc, false);
+
+	// turn off any notes which were left on by the removed events
+	this->releaseNotes(true);
+
+	rc = drainOutput();
+	TEST(rc, false);
+
 	return true;
 }
 
 // ------------------------------------------------------------------------------------------------
 ulong MIDIOutput::streamTime() const
 {
-	// TODO
+	if (m_info->queue < 0) return 0;
 
-	return 0;
+	snd_seq_queue_status_t *status;
+	snd_seq_queue_status_alloca(&status);
+
+	if (0 > snd_seq_get_queue_status(ALSA::seq_handle, m_info->queue, status))
+		return 0;
+
+	return snd_seq_queue_status_get_tick_time(status);
 }
 
 // ------------------------------------------------------------------------------------------------
 bool MIDIOutput::isStreamOpen() const
 {
-	// TODO
-	return false;
+	return m_info->queue >= 0;
 }
 
 // ------------------------------------------------------------------------------------------------
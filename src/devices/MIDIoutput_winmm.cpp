@@ -3,6 +3,7 @@
  */
 
 #include "MIDIoutput.h"
+#include <QAtomicInt>
 #include <Windows.h>
 
 // stream buffer size has to be less than 64kb (but not exactly 64kb)
@@ -28,6 +29,9 @@ struct OutputInfo
 	HMIDIOUT handle;
 	MIDIOUTCAPS caps;
 
+	// nesting level of beginBatch() calls
+	QAtomicInt batchDepth;
+
 	/* Stream-related info */
 	HMIDISTRM stream;
 	MIDIHDR header[2];
@@ -168,6 +172,8 @@ bool MIDIOutput::open()
 								 (DWORD_PTR)midiCallback, (DWORD_PTR)this, CALLBACK_FUNCTION);
 	TEST(result, false);
 
+	this->resetChannelState();
+
 	// device was opened successfully
 	return true;
 }
@@ -223,20 +229,26 @@ bool MIDIOutput::reset()
 	MMRESULT result = midiOutReset(handle);
 	TEST(result, false);
 
+	// midiOutReset has already turned off all notes
+	this->forgetNotes(false);
+	this->forgetNotes(true);
+	this->resetChannelState();
+
 	return true;
 }
 
 // ------------------------------------------------------------------------------------------------
-void MIDIOutput::send(quint8 data0, quint8 data1, quint8 data2)
+void MIDIOutput::sendShort(MIDIMessage message)
 {
 	HMIDIOUT handle = m_info->stream ? (HMIDIOUT)m_info->stream : m_info->handle;
 
-	MMRESULT result = midiOutShortMsg(handle, data0 | (data1 << 8) | (data2 << 16));
+	// (messages are already packed the way WinMM wants them)
+	MMRESULT result = midiOutShortMsg(handle, message.packed);
 	TEST(result);
 }
 
 // ------------------------------------------------------------------------------------------------
-void MIDIOutput::send(const QByteArray &data)
+void MIDIOutput::sendLong(const QByteArray &data)
 {
 	HMIDIOUT handle = m_info->stream ? (HMIDIOUT)m_info->stream : m_info->handle;
 
@@ -274,6 +286,26 @@ void MIDIOutput::send(const QByteArray &data)
 	}
 }
 
+// ------------------------------------------------------------------------------------------------
+void MIDIOutput::beginBatch()
+{
+	// WinMM sends every message immediately, so batches only need to be kept track of
+	m_info->batchDepth.ref();
+}
+
+// ------------------------------------------------------------------------------------------------
+bool MIDIOutput::commitBatch()
+{
+	int depth;
+	do
+	{
+		depth = m_info->batchDepth.loadAcquire();
+		if (!depth) return false;
+	} while (!m_info->batchDepth.testAndSetOrdered(depth, depth - 1));
+
+	return true;
+}
+
 // ------------------------------------------------------------------------------------------------
 bool MIDIOutput::streamOpen()
 {
@@ -288,6 +320,7 @@ bool MIDIOutput::streamOpen()
 	TEST(result, false);
 
 	m_info->streamPlaying = false;
+	this->resetChannelState();
 
 	// prepare double buffers
 	for (int i = 0; i < 2; i++)
@@ -306,109 +339,83 @@ bool MIDIOutput::streamOpen()
 }
 
 // ------------------------------------------------------------------------------------------------
-static void addMIDIEvent(QByteArray &data, MIDIEVENT &event)
-{
-	data.append((const char*)&event.dwDeltaTime, sizeof(DWORD));
-	data.append((const char*)&event.dwStreamID , sizeof(DWORD));
-	data.append((const char*)&event.dwEvent    , sizeof(DWORD));
-}
-
-// ------------------------------------------------------------------------------------------------
-void MIDIOutput::streamSend(uint time, quint8 data0, quint8 data1, quint8 data2)
-{
-	MIDIEVENT event;
-
-	event.dwDeltaTime = time;
-	event.dwStreamID = 0;
-	event.dwEvent = data0 | (data1 << 8) | (data2 << 16) | (MEVT_SHORTMSG << 24);
-
-	addMIDIEvent(m_buffer, event);
-}
-
-// ------------------------------------------------------------------------------------------------
-void MIDIOutput::streamSend(uint time, const QByteArray &data)
-{
-	// ignore messages that are too long
-	if (data.size() >= (1 << 16)) return;
-
-	MIDIEVENT event;
-
-	event.dwDeltaTime = time;
-	event.dwStreamID = 0;
-	event.dwEvent = data.size() | (MEVT_LONGMSG << 24);
-
-	addMIDIEvent(m_buffer, event);
-
-	m_buffer.append(data);
-	// make sure this is padded to DWORD size
-	// TODO: test
-	for (int i = data.size(); i % sizeof(DWORD); i++)
-	{
-		m_buffer.append('\0');
-	}
-}
-
-// ------------------------------------------------------------------------------------------------
-void MIDIOutput::streamSetTempo(uint time, double bpm)
+bool MIDIOutput::streamFlushBuffer()
 {
-	MIDIEVENT event;
-
-	event.dwDeltaTime = time;
-	event.dwStreamID = 0;
-	uint tempo = (60 * 1000000) / bpm;
-	// ignore tempos that are too low
-	if (tempo >= (1 << 24)) return;
-
-	event.dwEvent = tempo | (MEVT_TEMPO << 24);
-
-	addMIDIEvent(m_buffer, event);
-}
-
-// ------------------------------------------------------------------------------------------------
-void MIDIOutput::streamDelay(uint time)
-{
-	MIDIEVENT event;
-
-	event.dwDeltaTime = time;
-	event.dwStreamID = 0;
-	event.dwEvent = MEVT_NOP << 24;
-
-	addMIDIEvent(m_buffer, event);
-}
-
-// ------------------------------------------------------------------------------------------------
-void MIDIOutput::streamSetMarker(uint time, uint value)
-{
-	// ignore values that are too high
-	if (value >= (1 << 24)) return;
-
-	MIDIEVENT event;
-
-	event.dwDeltaTime = time;
-	event.dwStreamID = 0;
-	event.dwEvent = value | (MEVT_NOP << 24) | MEVT_F_CALLBACK;
-
-	addMIDIEvent(m_buffer, event);
-}
-
-// ------------------------------------------------------------------------------------------------
-bool MIDIOutput::streamFlush()
-{
-	// if current MIDI stream buffer is ready for more data, dump the QByteArray into it
+	// if current MIDI stream buffer is ready for more data, translate the stream events into it
 	// and switch to the other stream buffer
 
 	auto &header = m_info->header[m_info->currHeader];
 
 	if (!m_info->streamPlaying)
 	{
+		// anything selected by the discarded events was never sent
 		m_buffer.clear();
+		this->resetChannelState();
 		return true;
 	}
 	else if (!(header.dwFlags & MHDR_INQUEUE) && header.lpData)
 	{
-		header.dwBytesRecorded = qMin(STREAM_BUF_SIZE, (unsigned)m_buffer.size());
-		memcpy(header.lpData, m_buffer.constData(), header.dwBytesRecorded);
-		m_buffer.clear();
+		DWORD *pos = reinterpret_cast<DWORD*>(header.lpData);
+		DWORD *end = pos + (STREAM_BUF_SIZE / sizeof(DWORD));
+
+		uint sent = 0;
+		for (const MIDIStreamEvent &event : m_buffer)
+		{
+			DWORD data = event.value();
+			uint size = 0;
+
+			switch (event.type())
+			{
+			case MIDIStreamEvent::Short:
+				data |= (MEVT_SHORTMSG << 24);
+				break;
+
+			case MIDIStreamEvent::Long:
+				size = m_buffer.longSize(event);
+				// replace messages that are too long for a buffer with a delay
+				if (size > STREAM_BUF_SIZE - 3 * sizeof(DWORD))
+				{
+					data = MEVT_NOP << 24;
+					size = 0;
+				}
+				else
+				{
+					data = size | (MEVT_LONGMSG << 24);
+				}
+				break;
+
+			case MIDIStreamEvent::Tempo:
+				data |= (MEVT_TEMPO << 24);
+				break;
+
+			case MIDIStreamEvent::Marker:
+				data |= (MEVT_NOP << 24) | MEVT_F_CALLBACK;
+				break;
+
+			default:
+				data = MEVT_NOP << 24;
+				break;
+			}
+
+			// (long messages are padded to DWORD size in the stream buffer already)
+			uint words = 3 + (size + sizeof(DWORD) - 1) / sizeof(DWORD);
+			if (pos + words > end)
+				break;
+
+			// same layout as MIDIEVENT (without dwParms)
+			pos[0] = event.time;
+			pos[1] = 0;
+			pos[2] = data;
+			if (size)
+				memcpy(pos + 3, m_buffer.longData(event), (words - 3) * sizeof(DWORD));
+
+			pos += words;
+			sent++;
+		}
+
+		header.dwBytesRecorded = (pos - reinterpret_cast<DWORD*>(header.lpData)) * sizeof(DWORD);
+		// whatever didn't fit goes in the next buffer
+		m_buffer.removeFirst(sent);
 
 		MMRESULT result = midiStreamOut(m_info->stream, &header, sizeof(MIDIHDR));
 		TEST(result, false);
@@ -423,6 +430,12 @@ bool MIDIOutput::streamFlush()
 // ------------------------------------------------------------------------------------------------
 bool MIDIOutput::streamStart(double bpm, uint ppq)
 {
+	if (bpm <= 0 || !ppq)
+	{
+		emit this->error(tr("tried to start a stream with an invalid tempo or timebase"));
+		return false;
+	}
+
 	ulong time = this->streamTime();
 
 	MMRESULT result = midiStreamRestart(m_info->stream);
@@ -445,6 +458,7 @@ bool MIDIOutput::streamStart(double bpm, uint ppq)
 //		TEST(result, false);
 
 		m_info->currHeader = 0;
+		this->resetSchedule(bpm, ppq);
 
 		for (int i = 0; i < 2; i++)
 		{
@@ -472,10 +486,19 @@ bool MIDIOutput::streamStop()
 	MMRESULT result = midiStreamStop(m_info->stream);
 	TEST(result, false);
 
+	// midiStreamStop has already turned off all notes
 	m_info->streamPlaying = false;
+	this->forgetNotes(true);
+	this->resetChannelState();
 	return true;
 }
 
+// ------------------------------------------------------------------------------------------------
+void MIDIOutput::streamUpdate()
+{
+	// (finished buffers and markers are reported by the output callback directly)
+}
+
 // ------------------------------------------------------------------------------------------------
 ulong MIDIOutput::streamTime() const
 {
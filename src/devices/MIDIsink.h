@@ -0,0 +1,252 @@
+/*
+ * Interface for anything which MIDI messages can be sent to, live or not.
+ *
+ * MIDIOutput implements this for actual devices, and MIDIBufferSink collects messages in memory
+ * (e.g. for rendering a song offline). MIDIBatchSink sits in front of another sink to pass
+ * bursts of messages on all at once. Instruments only need a sink to play on.
+ *
+ * Messages are either sent immediately, or to a stream with a timestamp (in ticks) relative to
+ * the previous message, as described in MIDIoutput.h. Sinks without a clock of their own just
+ * treat immediate messages as stream messages with a timestamp of 0.
+ */
+
+#ifndef MIDISINK_H
+#define MIDISINK_H
+
+#include "MIDIchannels.h"
+#include "MIDImessage.h"
+#include "MIDIstream.h"
+#include <QByteArray>
+#include <QVector>
+
+class MIDISink
+{
+public:
+	virtual ~MIDISink() {}
+
+	/* \returns the shadow state of this sink's channels (see MIDIchannels.h)
+	 */
+	virtual MIDIChannelState& channels() = 0;
+
+	virtual void send(MIDIMessage message)
+	{
+		streamSend(0, message);
+	}
+	// (sinks which can do better than one message at a time should override these)
+	virtual void send(const MIDIMessage *messages, uint count)
+	{
+		for (uint i = 0; i < count; i++)
+			send(messages[i]);
+	}
+	virtual void send(const QByteArray &data)
+	{
+		streamSend(0, data);
+	}
+	virtual void sendRPN(quint8 channel, quint16 param, quint16 value)
+	{
+		streamSendRPN(0, channel, param, value);
+	}
+	virtual void sendNRPN(quint8 channel, quint16 param, quint16 value)
+	{
+		streamSendNRPN(0, channel, param, value);
+	}
+
+	virtual void beginBatch() {}
+	virtual bool commitBatch() { return true; }
+
+	virtual void streamSend(uint time, MIDIMessage message) = 0;
+	virtual void streamSend(const MIDITimedMessage *messages, uint count)
+	{
+		for (uint i = 0; i < count; i++)
+			streamSend(messages[i].time, messages[i].message);
+	}
+	virtual void streamSend(uint time, const QByteArray &data) = 0;
+	virtual void streamSendRPN(uint time, quint8 channel, quint16 param, quint16 value)
+	{
+		sendParam(time, channel, CC_RPN_MSB, param, value);
+	}
+	virtual void streamSendNRPN(uint time, quint8 channel, quint16 param, quint16 value)
+	{
+		sendParam(time, channel, CC_NRPN_MSB, param, value);
+	}
+	// (sinks which don't care about tempo just keep the timing)
+	virtual void streamSetTempo(uint time, double bpm)
+	{
+		Q_UNUSED(bpm);
+		streamDelay(time);
+	}
+	// (sinks which don't keep track of which notes are on just keep the timing)
+	virtual void streamNotesOff(uint time)
+	{
+		streamDelay(time);
+	}
+	virtual void streamDelay(uint time) = 0;
+
+private:
+	// select the parameter, set it, then deselect it again
+	// (type is the controller for the parameter MSB, and the LSB is always the one right before it)
+	void sendParam(uint time, quint8 channel, quint8 type, quint16 param, quint16 value)
+	{
+		streamSend(time, MIDIMessage::control(channel, type,     MIDI_MSB(param)));
+		streamSend(0,    MIDIMessage::control(channel, type - 1, MIDI_LSB(param)));
+
+		streamSend(0,    MIDIMessage::control(channel, CC_DATA_ENTRY_MSB, MIDI_MSB(value)));
+		streamSend(0,    MIDIMessage::control(channel, CC_DATA_ENTRY_LSB, MIDI_LSB(value)));
+
+		streamSend(0,    MIDIMessage::control(channel, type,     MIDI_MSB(RPN_RESET)));
+	}
+};
+
+/*
+ * A sink which collects everything sent to it in a stream buffer, with each event's time
+ * relative to the previous event (delays are added to the time of the next event instead).
+ */
+class MIDIBufferSink : public MIDISink
+{
+public:
+	MIDIChannelState& channels() { return m_channels; }
+
+	void streamSend(uint time, MIDIMessage message)
+	{
+		m_buffer.addShort(m_pending + time, message);
+		m_pending = 0;
+	}
+	void streamSend(uint time, const QByteArray &data)
+	{
+		if (m_buffer.addLong(m_pending + time, data))
+			m_pending = 0;
+		else
+			m_pending += time;
+	}
+	void streamSetTempo(uint time, double bpm)
+	{
+		if (m_buffer.addTempo(m_pending + time, bpm > 0 ? (60 * 1000000) / bpm : 0))
+			m_pending = 0;
+		else
+			m_pending += time;
+	}
+	void streamDelay(uint time)
+	{
+		m_pending += time;
+	}
+
+	const MIDIStreamBuffer& events() const { return m_buffer; }
+	// the time from the last event to the end of everything sent so far
+	uint pendingTime() const { return m_pending; }
+
+	void clear()
+	{
+		m_buffer.clear();
+		m_channels.clear();
+		m_pending = 0;
+	}
+
+private:
+	MIDIStreamBuffer m_buffer;
+	MIDIChannelState m_channels;
+	uint m_pending = 0;
+};
+
+/*
+ * A sink which holds on to short stream messages and passes them on to another sink all at once
+ * (see flush()), e.g. everything played on one row of a song. Anything else sent to the stream
+ * passes on the messages held so far first, so everything stays in order. Immediate messages
+ * are passed on right away.
+ */
+class MIDIBatchSink : public MIDISink
+{
+public:
+	MIDIBatchSink(MIDISink *out)
+		: m_out(out)
+	{
+	}
+
+	MIDIChannelState& channels() { return m_out->channels(); }
+
+	void send(MIDIMessage message) { m_out->send(message); }
+	void send(const MIDIMessage *messages, uint count) { m_out->send(messages, count); }
+	void send(const QByteArray &data) { m_out->send(data); }
+	void sendRPN(quint8 channel, quint16 param, quint16 value)
+	{
+		m_out->sendRPN(channel, param, value);
+	}
+	void sendNRPN(quint8 channel, quint16 param, quint16 value)
+	{
+		m_out->sendNRPN(channel, param, value);
+	}
+
+	void beginBatch() { m_out->beginBatch(); }
+	bool commitBatch() { return m_out->commitBatch(); }
+
+	void streamSend(uint time, MIDIMessage message)
+	{
+		MIDITimedMessage event = {m_pending + time, message};
+		m_messages.append(event);
+		m_pending = 0;
+	}
+	void streamSend(const MIDITimedMessage *messages, uint count)
+	{
+		for (uint i = 0; i < count; i++)
+			streamSend(messages[i].time, messages[i].message);
+	}
+	void streamSend(uint time, const QByteArray &data)
+	{
+		time += flushMessages();
+		m_out->streamSend(time, data);
+	}
+	void streamSendRPN(uint time, quint8 channel, quint16 param, quint16 value)
+	{
+		time += flushMessages();
+		m_out->streamSendRPN(time, channel, param, value);
+	}
+	void streamSendNRPN(uint time, quint8 channel, quint16 param, quint16 value)
+	{
+		time += flushMessages();
+		m_out->streamSendNRPN(time, channel, param, value);
+	}
+	void streamSetTempo(uint time, double bpm)
+	{
+		time += flushMessages();
+		m_out->streamSetTempo(time, bpm);
+	}
+	void streamNotesOff(uint time)
+	{
+		time += flushMessages();
+		m_out->streamNotesOff(time);
+	}
+	void streamDelay(uint time)
+	{
+		m_pending += time;
+	}
+
+	/* Pass on everything held so far, including the delay after the last message.
+	 */
+	void flush()
+	{
+		if (uint time = flushMessages())
+			m_out->streamDelay(time);
+	}
+
+private:
+	// pass on the messages held so far (but not the delay after them)
+	// \returns the delay after the last message
+	uint flushMessages()
+	{
+		if (!m_messages.isEmpty())
+		{
+			m_out->streamSend(m_messages.constData(), m_messages.size());
+			// (this doesn't free the memory, so it can be reused next time)
+			m_messages.resize(0);
+		}
+
+		uint time = m_pending;
+		m_pending = 0;
+		return time;
+	}
+
+	MIDISink *m_out;
+	QVector<MIDITimedMessage> m_messages;
+	uint m_pending = 0;
+};
+
+#endif // MIDISINK_H
@@ -0,0 +1,201 @@
+/*
+ * Platform-neutral buffer of stream events.
+ *
+ * MIDIOutput collects stream events in one of these, and each platform translates the events
+ * into its own format when the stream is flushed. Every event is a fixed-size 8-byte record;
+ * the contents of long messages are kept in a separate arena, each padded to 4 bytes.
+ *
+ * The buffer only ever grows (by doubling), and clear() keeps the memory, so filling the same
+ * buffer again and again doesn't allocate anything once it has grown large enough.
+ */
+
+#ifndef MIDISTREAM_H
+#define MIDISTREAM_H
+
+#include "MIDImessage.h"
+#include <QByteArray>
+#include <QVector>
+#include <cstring>
+
+struct MIDIStreamEvent
+{
+	enum Type
+	{
+		Short,  // value is a packed MIDIMessage
+		Long,   // value is the offset of the message in the arena
+		Tempo,  // value is the tempo in microseconds per quarter note
+		Delay,  // does nothing but take up time
+		Marker  // value is the marker value
+	};
+
+	// time in ticks (relative to the previous event, unless the owner of the buffer says otherwise)
+	quint32 time;
+	// event type in the upper 8 bits, value in the lower 24 bits
+	quint32 data;
+
+	Type type() const { return Type(data >> 24); }
+	quint32 value() const { return data & 0xFFFFFF; }
+	MIDIMessage message() const { return MIDIMessage::fromPacked(value()); }
+};
+
+Q_DECLARE_TYPEINFO(MIDIStreamEvent, Q_PRIMITIVE_TYPE);
+
+class MIDIStreamBuffer
+{
+public:
+	/* \param events the number of events to make room for initially
+	 * \param arena the number of bytes of long messages to make room for initially
+	 */
+	explicit MIDIStreamBuffer(uint events = 1024, uint arena = 4096)
+		: m_count(0)
+		, m_arenaSize(0)
+	{
+		m_events.resize(events);
+		m_arena.resize(arena);
+	}
+
+	void clear()
+	{
+		m_count = 0;
+		m_arenaSize = 0;
+	}
+
+	bool isEmpty() const { return !m_count; }
+	uint size() const { return m_count; }
+
+	const MIDIStreamEvent* begin() const { return m_events.constData(); }
+	const MIDIStreamEvent* end() const { return m_events.constData() + m_count; }
+	const MIDIStreamEvent& operator[](uint i) const { return m_events.constData()[i]; }
+
+	void addShort(quint32 time, MIDIMessage message)
+	{
+		append(time, MIDIStreamEvent::Short, message.packed);
+	}
+
+	/* Values which don't fit in 24 bits (e.g. long messages of 16 MB or more,
+	 * or absurdly slow tempos) are ignored.
+	 * \returns whether or not the event was added
+	 */
+	bool addLong(quint32 time, const char *data, uint size)
+	{
+		const uint needed = m_arenaSize + 4 + ((size + 3) & ~3u);
+		if (size >= (1 << 24) || needed >= (1 << 24))
+			return false;
+
+		if (needed > (uint)m_arena.size())
+			m_arena.resize(qMax(needed, 2u * m_arena.size()));
+
+		char *pos = m_arena.data() + m_arenaSize;
+		const quint32 length = size;
+		memcpy(pos, &length, 4);
+		memcpy(pos + 4, data, size);
+		memset(pos + 4 + size, 0, needed - m_arenaSize - 4 - size);
+
+		append(time, MIDIStreamEvent::Long, m_arenaSize);
+		m_arenaSize = needed;
+		return true;
+	}
+	bool addLong(quint32 time, const QByteArray &data)
+	{
+		return addLong(time, data.constData(), data.size());
+	}
+	bool addTempo(quint32 time, uint usPerQuarter)
+	{
+		if (!usPerQuarter || usPerQuarter >= (1 << 24))
+			return false;
+
+		append(time, MIDIStreamEvent::Tempo, usPerQuarter);
+		return true;
+	}
+	void addDelay(quint32 time)
+	{
+		append(time, MIDIStreamEvent::Delay, 0);
+	}
+	bool addMarker(quint32 time, uint value)
+	{
+		if (value >= (1 << 24))
+			return false;
+
+		append(time, MIDIStreamEvent::Marker, value);
+		return true;
+	}
+
+	// copy an event from another buffer (along with its message, if it's a long one)
+	// \returns whether or not the event was added
+	bool add(quint32 time, const MIDIStreamEvent &event, const MIDIStreamBuffer &from)
+	{
+		if (event.type() == MIDIStreamEvent::Long)
+			return addLong(time, from.longData(event), from.longSize(event));
+
+		append(time, event.type(), event.value());
+		return true;
+	}
+
+	// throw away the first few events and keep the rest
+	// (this moves everything that's left to the front, instead of allocating anything)
+	void removeFirst(uint count)
+	{
+		if (count >= m_count)
+		{
+			clear();
+			return;
+		}
+
+		MIDIStreamEvent *events = m_events.data();
+		m_count -= count;
+		memmove(events, events + count, m_count * sizeof(MIDIStreamEvent));
+
+		// long messages are kept in the arena in order, so the first one left is where the rest
+		// of the arena starts
+		uint start = m_arenaSize;
+		for (uint i = 0; i < m_count; i++)
+		{
+			if (events[i].type() == MIDIStreamEvent::Long)
+			{
+				start = events[i].value();
+				break;
+			}
+		}
+
+		if (!start) return;
+
+		char *arena = m_arena.data();
+		m_arenaSize -= start;
+		memmove(arena, arena + start, m_arenaSize);
+
+		for (uint i = 0; i < m_count; i++)
+		{
+			if (events[i].type() == MIDIStreamEvent::Long)
+				events[i].data = (MIDIStreamEvent::Long << 24) | (events[i].value() - start);
+		}
+	}
+
+	// the contents of a long message
+	const char* longData(const MIDIStreamEvent &event) const
+	{
+		return m_arena.constData() + event.value() + 4;
+	}
+	uint longSize(const MIDIStreamEvent &event) const
+	{
+		quint32 size;
+		memcpy(&size, m_arena.constData() + event.value(), 4);
+		return size;
+	}
+
+private:
+	void append(quint32 time, MIDIStreamEvent::Type type, quint32 value)
+	{
+		if (m_count >= (uint)m_events.size())
+			m_events.resize(qMax(64, 2 * m_events.size()));
+
+		MIDIStreamEvent &event = m_events.data()[m_count++];
+		event.time = time;
+		event.data = (type << 24) | (value & 0xFFFFFF);
+	}
+
+	QVector<MIDIStreamEvent> m_events;
+	QByteArray m_arena;
+	uint m_count, m_arenaSize;
+};
+
+#endif // MIDISTREAM_H
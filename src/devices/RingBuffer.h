@@ -0,0 +1,90 @@
+/*
+ * Lock-free ring buffer for passing data from one producer thread to one consumer thread.
+ *
+ * push() may only be called from the producer thread, and pop() / isEmpty() only from the
+ * consumer thread. Neither one ever blocks or allocates memory.
+ */
+
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <QAtomicInteger>
+
+template <typename T, uint Size>
+class RingBuffer
+{
+	static_assert(Size && !(Size & (Size - 1)), "ring buffer size must be a power of two");
+
+public:
+	RingBuffer()
+		: m_head(0)
+		, m_tail(0)
+	{
+	}
+
+	/* Add an item to the buffer.
+	 * \param reserve how many slots to leave free for more important items
+	 * \returns false if the buffer is full (in which case the item is discarded)
+	 */
+	bool push(const T &item, uint reserve = 0)
+	{
+		uint head = m_head.load();
+		if (head - m_tail.loadAcquire() + reserve >= Size)
+			return false;
+
+		m_data[head & (Size - 1)] = item;
+		m_head.storeRelease(head + 1);
+		return true;
+	}
+
+	/* Add several items to the buffer at once, or none of them at all.
+	 * \returns false if there isn't room for all of them
+	 */
+	bool push(const T *items, uint count)
+	{
+		uint head = m_head.load();
+		if (head - m_tail.loadAcquire() + count > Size)
+			return false;
+
+		for (uint i = 0; i < count; i++)
+		{
+			m_data[(head + i) & (Size - 1)] = items[i];
+		}
+
+		m_head.storeRelease(head + count);
+		return true;
+	}
+
+	/* Remove up to a given number of items from the buffer.
+	 * \returns the number of items actually removed
+	 */
+	uint pop(T *items, uint count)
+	{
+		uint tail = m_tail.load();
+		uint available = m_head.loadAcquire() - tail;
+		if (count > available)
+			count = available;
+
+		for (uint i = 0; i < count; i++)
+		{
+			items[i] = m_data[(tail + i) & (Size - 1)];
+		}
+
+		m_tail.storeRelease(tail + count);
+		return count;
+	}
+
+	bool isEmpty() const
+	{
+		return m_head.loadAcquire() == m_tail.load();
+	}
+
+private:
+	T m_data[Size];
+
+	// total number of items pushed and popped (wrapping around)
+	QAtomicInteger<uint> m_head;
+	QAtomicInteger<uint> m_tail;
+};
+
+#endif // RINGBUFFER_H
@@ -1,7 +1,16 @@
 #include "alsa.h"
 #include "MIDIdefs.h"
+#include "MIDIinput.h"
+#include "MIDIoutput.h"
 
-#include <QElapsedTimer>
+#include <QCoreApplication>
+
+#include <cerrno>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// number of events which the sequencer can hold for us in its output queue
+#define OUTPUT_POOL_SIZE 2000
 
 using namespace ALSA;
 
@@ -9,9 +18,16 @@ snd_seq_t* ALSA::seq_handle = nullptr;
 int ALSA::seq_client = -1;
 int ALSA::seq_inport = -1;
 int ALSA::seq_outport = -1;
+int ALSA::seq_inqueue = -1;
+QMutex ALSA::outputLock;
+
+static InputThread *inputThread = nullptr;
 
 static void deinit()
 {
+	snd_seq_free_queue(seq_handle, seq_inqueue);
+	seq_inqueue = -1;
+
 	snd_seq_delete_simple_port(seq_handle, seq_inport);
 	seq_inport = -1;
 
@@ -37,6 +53,11 @@ int ALSA::init()
 	rc = snd_seq_set_client_name(seq_handle, "Decomposer MIDI Interface");
 	if (rc) return rc;
 
+	// make room for a couple of buffers' worth of scheduled stream events
+	// (this is shared by every stream output)
+	rc = snd_seq_set_client_pool_output(seq_handle, OUTPUT_POOL_SIZE);
+	if (rc) return rc;
+
 	seq_inport = snd_seq_create_simple_port(seq_handle, "Decomposer (in)",
 										  SND_SEQ_PORT_CAP_WRITE,
 										  SND_SEQ_PORT_TYPE_APPLICATION);
@@ -50,10 +71,31 @@ int ALSA::init()
 	seq_client = snd_seq_client_id(seq_handle);
 	if (seq_client < 0) return seq_client;
 
+	// start a queue for timestamping input, which keeps running until we exit
+	seq_inqueue = snd_seq_alloc_named_queue(seq_handle, "Decomposer input");
+	if (seq_inqueue < 0) return seq_inqueue;
+
+	rc = snd_seq_start_queue(seq_handle, seq_inqueue, nullptr);
+	if (rc < 0) return rc;
+	rc = snd_seq_drain_output(seq_handle);
+	if (rc < 0) return rc;
+
 	atexit(deinit);
 	return 0;
 }
 
+quint64 ALSA::inputTime()
+{
+	snd_seq_queue_status_t *status;
+	snd_seq_queue_status_alloca(&status);
+
+	if (0 > snd_seq_get_queue_status(seq_handle, seq_inqueue, status))
+		return 0;
+
+	const snd_seq_real_time_t *time = snd_seq_queue_status_get_real_time(status);
+	return (quint64)time->tv_sec * 1000000 + time->tv_nsec / 1000;
+}
+
 QList<uint> ALSA::enumerate(int caps)
 {
 	QList<uint> ports;
@@ -94,24 +136,127 @@ QList<uint> ALSA::enumerate(int caps)
 	return ports;
 }
 
+static void startInputThread()
+{
+	if (!inputThread->isRunning())
+		inputThread->start(QThread::TimeCriticalPriority);
+}
+
+void ALSA::addInput(uint id, MIDIInput *device)
+{
+	if (!inputThread)
+		inputThread = new InputThread(qApp);
+
+	inputThread->addInput(id, device);
+	startInputThread();
+}
+
+void ALSA::removeInput(uint id)
+{
+	if (inputThread && !inputThread->removeInput(id))
+		inputThread->stop();
+}
+
+void ALSA::addOutput(uint id, MIDIOutput *device)
+{
+	if (!inputThread)
+		inputThread = new InputThread(qApp);
+
+	inputThread->addOutput(id, device);
+	startInputThread();
+}
+
+void ALSA::removeOutput(uint id)
+{
+	if (inputThread && !inputThread->removeOutput(id))
+		inputThread->stop();
+}
+
 InputThread::InputThread(QObject *parent)
 	: QThread(parent)
 {
 	this->handle = seq_handle;
 	this->npfd = snd_seq_poll_descriptors_count(this->handle, POLLIN);
-	this->pfd = (pollfd*)malloc(this->npfd * sizeof(pollfd));
+	// reserve one extra descriptor for wakeups
+	this->pfd = (pollfd*)malloc((this->npfd + 1) * sizeof(pollfd));
 	snd_seq_poll_descriptors(this->handle, this->pfd, this->npfd, POLLIN);
+
+	this->wakeFd = eventfd(0, EFD_NONBLOCK);
+	this->pfd[this->npfd].fd = this->wakeFd;
+	this->pfd[this->npfd].events = POLLIN;
+	this->pfd[this->npfd].revents = 0;
 }
 
 InputThread::~InputThread()
 {
+	this->stop();
+
+	close(this->wakeFd);
 	free(this->pfd);
 }
 
+void InputThread::stop()
+{
+	if (!this->isRunning())
+		return;
+
+	this->requestInterruption();
+
+	// (if the counter is already full, the thread has a wakeup pending anyway)
+	quint64 value = 1;
+	while (write(this->wakeFd, &value, sizeof(value)) < 0 && errno == EINTR)
+		;
+
+	// always wait, since the thread may still be running even if something went wrong above
+	this->wait();
+}
+
+void InputThread::addInput(uint id, MIDIInput *device)
+{
+	QMutexLocker locker(&this->lock);
+
+	InputRoute route;
+	route.device = device;
+	route.startTime = inputTime();
+
+	this->inputs.insert(id, route);
+}
+
+bool InputThread::removeInput(uint id)
+{
+	QMutexLocker locker(&this->lock);
+	this->inputs.remove(id);
+	bool left = !this->inputs.isEmpty() || !this->outputs.isEmpty();
+	locker.unlock();
+
+	// wait for the event being passed on right now (if any), in case it's for this device
+	QMutexLocker dispatch(&this->dispatchLock);
+	return left;
+}
+
+void InputThread::addOutput(uint id, MIDIOutput *device)
+{
+	QMutexLocker locker(&this->lock);
+
+	this->outputs.insert(id, device);
+}
+
+bool InputThread::removeOutput(uint id)
+{
+	QMutexLocker locker(&this->lock);
+	this->outputs.remove(id);
+	bool left = !this->inputs.isEmpty() || !this->outputs.isEmpty();
+	locker.unlock();
+
+	// wait for the event being passed on right now (if any), in case it's for this device
+	QMutexLocker dispatch(&this->dispatchLock);
+	return left;
+}
+
 void InputThread::run()
 {
 	snd_midi_event_t *decoder;
-	// TODO: change size for sysex
+	// SysEx events are handled separately, so this is only used for short messages
 	snd_midi_event_new(16, &decoder);
 
 	// don't use running status
@@ -121,40 +266,98 @@ void InputThread::run()
 
 	// short MIDI message buffer
 	quint8 data[3];
-	// input start time
-	QElapsedTimer timer;
-	timer.start();
 
 	while (!this->isInterruptionRequested())
 	{
-		do
+		// sleep until there is input (or until we're told to stop)
+		if (poll(this->pfd, this->npfd + 1, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (this->pfd[this->npfd].revents & POLLIN)
+		{
+			quint64 value;
+			if (read(this->wakeFd, &value, sizeof(value)) < 0)
+				break;
+			continue;
+		}
+
+		// handle everything that's pending
+		forever
 		{
-			if (poll(this->pfd, this->npfd, 100) <= 0)
+			int rc = snd_seq_event_input(this->handle, &ev);
+			if (rc == -ENOSPC)
+				// input overrun, but there's still more to read
+				continue;
+			else if (rc < 0)
 				break;
-			snd_seq_event_input(this->handle, &ev);
 
-			uint time = timer.elapsed();
+			QMutexLocker dispatch(&this->dispatchLock);
+
+			// stream outputs send echo events back to themselves when their queues reach a point
+			// they need to know about (e.g. the end of a buffer)
+			if (ev->type == SND_SEQ_EVENT_ECHO && ev->source.client == seq_client)
+			{
+				MIDIOutput *output;
+				{
+					QMutexLocker locker(&this->lock);
+					output = this->outputs.value(ev->data.raw32.d[0]);
+				}
+
+				if (output)
+					output->streamUpdate();
+
+				snd_seq_free_event(ev);
+				continue;
+			}
+
+			// find out which device this came from
+			uint id = (ev->source.client << 8) | ev->source.port;
+
+			InputRoute route;
+			{
+				QMutexLocker locker(&this->lock);
+
+				auto found = this->inputs.constFind(id);
+				if (found == this->inputs.constEnd())
+				{
+					snd_seq_free_event(ev);
+					continue;
+				}
+
+				// (the device can't be removed until the event has been passed on)
+				route = *found;
+			}
+
+			// use the time the event was received by the sequencer, if possible
+			quint64 time;
+			if (snd_seq_ev_is_real(ev))
+				time = (quint64)ev->time.time.tv_sec * 1000000 + ev->time.time.tv_nsec / 1000;
+			else
+				time = inputTime();
+
+			time = (time > route.startTime) ? time - route.startTime : 0;
 
 			switch (ev->type)
 			{
 			case SND_SEQ_EVENT_SYSEX:
-				// TODO
+				// long messages arrive in pieces, which the device puts back together
+				route.device->receiveSysEx((const char*)ev->data.ext.ptr, ev->data.ext.len, time);
 				break;
 
 			default:
 				if (0 < snd_midi_event_decode(decoder, data, 3, ev))
 				{
-					// TODO: timestamp
-					emit this->midiEvent(data[0], data[1], data[2], time);
+					route.device->queueEvent(MIDIMessage(data[0], data[1], data[2]), time);
 				}
 				break;
 			}
 
 			snd_seq_free_event(ev);
-
-		} while (snd_seq_event_input_pending(this->handle, 0) > 0);
-
-		QThread::msleep(1);
+		}
 	}
 
 	snd_midi_event_free(decoder);
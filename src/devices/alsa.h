@@ -2,20 +2,57 @@
 #define ALSA_H
 
 #include <alsa/asoundlib.h>
+#include <QHash>
 #include <QList>
+#include <QMutex>
 #include <QThread>
 
+class MIDIInput;
+class MIDIOutput;
+
 namespace ALSA
 {
 	extern snd_seq_t *seq_handle;
 	extern int seq_client;
 	extern int seq_inport, seq_outport;
+	// queue used to timestamp incoming events
+	extern int seq_inqueue;
+	// the client's output buffer is shared by every device and thread, so this is held
+	// while sending anything through it (or draining it)
+	extern QMutex outputLock;
 
 	int init();
 
+	/* \returns the current real time of the input queue (in microseconds)
+	 */
+	quint64 inputTime();
+
 	QList<uint> enumerate(int caps);
+
+	/* Deliver events from an input port (packed the same way as by enumerate()) to a device.
+	 * The input thread is started when the first input is added.
+	 */
+	void addInput(uint id, MIDIInput *device);
+	/* Stop delivering events from an input port.
+	 * The input thread is stopped when the last input or stream output is removed.
+	 */
+	void removeInput(uint id);
+
+	/* Pass echo events sent by a stream output (with its packed port number as the first data
+	 * word) back to it, so it can keep track of its stream (see MIDIOutput::streamUpdate()).
+	 * The input thread is started when the first stream output is added.
+	 */
+	void addOutput(uint id, MIDIOutput *device);
+	/* Stop passing echo events back to a stream output.
+	 * The input thread is stopped when the last input or stream output is removed.
+	 */
+	void removeOutput(uint id);
 }
 
+/*
+ * Reads all incoming events for the sequencer client and passes them on to the input device
+ * for the port they came from, or to the stream output that sent them back to itself.
+ */
 class InputThread : public QThread
 {
 	Q_OBJECT
@@ -25,13 +62,40 @@ public:
 	~InputThread();
 	void run();
 
-signals:
-	void midiEvent(quint8 event, quint8 data1, quint8 data2, uint time);
+	/* Interrupt the thread while it waits for input, and wait for it to finish.
+	 */
+	void stop();
+
+	void addInput(uint id, MIDIInput *device);
+	/* \returns whether or not any inputs or outputs are left
+	 */
+	bool removeInput(uint id);
+
+	void addOutput(uint id, MIDIOutput *device);
+	/* \returns whether or not any inputs or outputs are left
+	 */
+	bool removeOutput(uint id);
 
 private:
+	struct InputRoute
+	{
+		MIDIInput *device;
+		// time the device was added (in microseconds)
+		quint64 startTime;
+	};
+
+	QMutex lock;
+	QHash<uint, InputRoute> inputs;
+	QHash<uint, MIDIOutput*> outputs;
+	// held while an event is being passed on (without holding the other lock),
+	// so that a device can't be removed in the middle of it
+	QMutex dispatchLock;
+
 	snd_seq_t *handle;
 	int npfd;
 	struct pollfd *pfd;
+	// used to wake the thread up when it's waiting for input
+	int wakeFd;
 };
 
 #endif // ALSA_H
@@ -16,7 +16,7 @@ MainWindow::MainWindow(QWidget *parent)
 	auto *devicePanel = new DevicePanel();
 	ui->tabWidget->addTab(devicePanel, tr("Devices"));
 
-	auto *instrumentPanel = new InstrumentPanel();
+	auto *instrumentPanel = new InstrumentPanel(&m_song);
 	widgets.append(instrumentPanel);
 	ui->tabWidget->addTab(instrumentPanel, tr("Instruments"));
 
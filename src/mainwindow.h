@@ -3,6 +3,8 @@
 
 #include <QMainWindow>
 
+#include "Song.h"
+
 namespace Ui {
 class MainWindow;
 }
@@ -18,6 +20,7 @@ public:
 private:
 	Ui::MainWindow *ui;
 
+	Song m_song;
 };
 
 #endif // MAINWINDOW_H